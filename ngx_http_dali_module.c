@@ -32,28 +32,330 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <assert.h>
+#include <math.h>
+#if (NGX_HTTP_GZIP)
+#include <zlib.h>
+#endif
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#if (NGX_DALI_USDT)
+#include <sys/sdt.h>
+#endif
 // clang-format on
 // Turn clang-format back on.
 
+/*
+ * Static (USDT) tracepoints on the request lifecycle, compiled in
+ * with NGX_DALI_USDT=yes (see the `config` script). A disarmed
+ * probe is a single nop in the instruction stream, so these can
+ * stay in production builds; bpftrace can then attribute latency
+ * to Dali phases without whole-process sampling, e.g.:
+ *
+ *   bpftrace -e 'usdt:./nginx:dali:handler_enter { @[tid] = nsecs }
+ *                usdt:./nginx:dali:header_send
+ *                  { @lat = hist(nsecs - @[tid]); delete(@[tid]); }'
+ */
+#if (NGX_DALI_USDT)
+#define ngx_http_dali_probe1(name, a1)     DTRACE_PROBE1(dali, name, a1)
+#define ngx_http_dali_probe2(name, a1, a2) DTRACE_PROBE2(dali, name, a1, a2)
+#else
+#define ngx_http_dali_probe1(name, a1)
+#define ngx_http_dali_probe2(name, a1, a2)
+#endif
+
+/*
+ * Per-request debug logging. Even with debug logging disabled at
+ * runtime, a bare ngx_log_error call still pays for its argument
+ * setup on every request, so the hot path funnels all of its
+ * debug output through this macro: a single branch on the log
+ * level when built normally, and nothing at all when the module
+ * is compiled with NGX_DALI_NDEBUG (see the `config` script).
+ */
+#if (NGX_DALI_NDEBUG)
+#define ngx_http_dali_log_debug(log, fmt, arg)
+#else
+#define ngx_http_dali_log_debug(log, fmt, arg)                                 \
+  do {                                                                         \
+    if ((log)->log_level >= NGX_LOG_DEBUG) {                                   \
+      ngx_log_error(NGX_LOG_DEBUG, (log), 0, fmt, arg);                        \
+    }                                                                          \
+  } while (0)
+#endif
+
+/*
+ * How a response body is produced.
+ *
+ * In `file` mode (the default, and the historical behavior) the
+ * body is an in_file buffer over /dev/zero that nginx reads and
+ * copies. In `memory` mode the body is served directly from a
+ * pre-zeroed region that each worker sets up at startup, so no
+ * read(2) happens at all.
+ */
+#define NGX_HTTP_DALI_MODE_FILE     0
+#define NGX_HTTP_DALI_MODE_MEMORY   1
+#define NGX_HTTP_DALI_MODE_SENDFILE 2
+#define NGX_HTTP_DALI_MODE_ECHO     3
+
+/*
+ * What the response bytes look like.
+ *
+ * `zero` (the default) is all zeros, which any middlebox will
+ * happily compress to nothing. `random` serves slices of a
+ * pseudorandom arena that each worker fills once at startup, so
+ * bodies are incompressible and bandwidth numbers measured
+ * through caches and CDNs stay honest. `counter <seed>` makes
+ * byte i of the body a pure function of (seed, i) -- the bytes
+ * of splitmix64(seed + i/8), little-endian -- so a client can
+ * verify any byte range without fetching the rest of the body.
+ */
+#define NGX_HTTP_DALI_PAYLOAD_ZERO    0
+#define NGX_HTTP_DALI_PAYLOAD_RANDOM  1
+#define NGX_HTTP_DALI_PAYLOAD_COUNTER 2
+
+/*
+ * Response-size distributions (`dali uniform 1k 10m`,
+ * `dali pareto 1k 10m 1.3`, `dali lognormal 16k 1.5 [10m]`).
+ * The heavy-tailed samplers precompute an inverse-CDF lookup
+ * table at configuration time, so drawing a size per request is
+ * one PRNG call and one table load -- no floating point at all
+ * on the hot path. Uniform needs no table.
+ */
+#define NGX_HTTP_DALI_DIST_NONE      0
+#define NGX_HTTP_DALI_DIST_UNIFORM   1
+#define NGX_HTTP_DALI_DIST_PARETO    2
+#define NGX_HTTP_DALI_DIST_LOGNORMAL 3
+
+#define NGX_HTTP_DALI_DIST_TABLE_SIZE 1024
+
 /*
  * The data structure that holds the configuration that the user
  * provides for the Dali module.
  *
- * There is only one customizable value.
+ * When the `dali` directive is given a literal size, only
+ * `length` is used. When it is given something containing
+ * variables (e.g. `dali $arg_size`), `length_cv` holds the
+ * compiled complex value that the handler evaluates per request,
+ * and `max_length` caps whatever the client asks for.
  */
 struct ngx_http_dali_conf_s {
-  size_t length;
+  size_t                    length;
+  size_t                    max_length;
+  ngx_uint_t                mode;
+  ngx_uint_t                payload;
+  ngx_flag_t                discard_body;
+  ngx_http_complex_value_t *length_cv;
+
+  /*
+   * `dali unbounded`: the response has no length at all -- no
+   * Content-Length goes out and the body streams until the client
+   * disconnects. Pairs naturally with `dali_stream` for a drip,
+   * but works at full speed without it.
+   */
+  ngx_uint_t                unbounded;
+
+  /*
+   * Directory for the sendfile backing file
+   * (`dali_sendfile_dir`). The file is one per worker, so merging
+   * folds this into the process-wide setting the worker startup
+   * hook reads, the same way the maximum length is folded.
+   */
+  ngx_str_t                 sendfile_dir;
+
+  /*
+   * Size-distribution sampling. `dist_table` holds the
+   * precomputed quantiles for the heavy-tailed distributions;
+   * uniform draws directly from [dist_min, dist_max].
+   */
+  ngx_uint_t                dist;
+  size_t                    dist_min;
+  size_t                    dist_max;
+  size_t                   *dist_table;
+
+  /*
+   * Cached response headers (`dali_cached_headers on`). For a
+   * fixed-length location every HTTP/1.x response carries the
+   * same header bytes except the Date, so they are serialized
+   * once per location (one variant per Connection disposition,
+   * indexed by r->keepalive) and replayed as a memory buffer,
+   * bypassing repeated header construction and the header filter
+   * chain. The Date field is patched in place each second.
+   */
+  ngx_flag_t                cached_headers;
+  ngx_str_t                 header_blob[2];
+  size_t                    header_date_offset[2];
+
+  /*
+   * Serve precompressed bodies (`dali_precompress on`): clients
+   * that accept gzip get a blob compressed once at worker
+   * startup instead of making the gzip filter chew through
+   * megabytes of zeros per request.
+   */
+  ngx_flag_t                precompress;
+
+  /*
+   * Ring of reusable output buffers (`dali_buffers N size`).
+   * When set, a response longer than one buffer is streamed
+   * through N fixed-size buffers that are refilled as the output
+   * filter drains them, so even a 10 GB body has a bounded
+   * per-connection footprint. num == 0 means one-shot output.
+   */
+  ngx_bufs_t                bufs;
+
+  /*
+   * Pacing (`dali_rate <bytes/s>`). Zero means "as fast as the
+   * socket drains". Pacing rides on the streaming path and its
+   * per-connection token bucket, so one worker can pace any
+   * number of connections with nothing but timer insertions.
+   */
+  size_t                    rate;
+
+  /*
+   * The seed for `dali_payload counter`, fixed at configuration
+   * time so the generated bytes are reproducible fleet-wide.
+   */
+  uint64_t                  payload_seed;
+
+  /*
+   * The fault schedule (`dali_fault`): NULL when the location
+   * injects no faults, otherwise a table of
+   * NGX_HTTP_DALI_FAULT_TABLE_SIZE slots holding fault kinds.
+   */
+  u_char                   *fault_table;
+
+  /*
+   * Slow-drip streaming (`dali_stream <chunk> <interval>`): emit
+   * one chunk per interval tick, up to the configured length, or
+   * for as long as the client stays connected when the location
+   * has no length at all. Rides the streaming ring, so in-flight
+   * data per stream is bounded by the ring no matter how slow
+   * the drip.
+   */
+  size_t                    stream_chunk;
+  ngx_msec_t                stream_interval;
+
+  /*
+   * Artificial first-byte latency (`dali_delay <time> [jitter]`).
+   * The response is held on a single event timer before the
+   * header is sent; the optional jitter is added uniformly at
+   * random per request.
+   */
+  ngx_msec_t                delay;
+  ngx_msec_t                delay_jitter;
+
+  /*
+   * A template for the response buffer, with every field that is
+   * identical from request to request (flags, mode bits) filled
+   * in once at configuration-merge time. The handler copies it
+   * with a single structure assignment and only touches the
+   * handful of per-request fields.
+   */
+  ngx_buf_t                 buffer_template;
 };
 typedef struct ngx_http_dali_conf_s ngx_http_dali_conf_t;
 
+/*
+ * The per-request context. The chain link, buffer, and file are
+ * embedded directly so that one ngx_pcalloc covers everything a
+ * request needs; this used to be four separate allocations and
+ * was our hottest allocation site. Memory mode may still chain
+ * extra links for bodies longer than the arena, but the common
+ * case never allocates beyond the context itself.
+ */
 struct ngx_http_dali_ctx_s {
   size_t       length;
-  ngx_str_t    dev_zero_path;
-  ngx_fd_t     dev_zero_fd;
+  ngx_uint_t   mode;
+  ngx_uint_t   payload;
+  ngx_chain_t  chain;
+  ngx_buf_t    buf;
+  ngx_file_t   file;
   ngx_buf_t   *buffer;
   ngx_chain_t *output_chain;
+
+  /*
+   * Streaming state, used only when the response goes out
+   * through the reusable buffer ring. `remaining` counts bytes
+   * not yet handed to the output filter and `offset` is the
+   * running position within the backing file.
+   */
+  size_t       remaining;
+  off_t        offset;
+  size_t       ring_buf_size;
+  ngx_uint_t   ring_size;
+  ngx_uint_t   ring_capacity;
+  ngx_buf_t   *ring_bufs;
+  ngx_chain_t *ring_links;
+
+  /*
+   * Writable backing storage for ring buffers whose content is
+   * generated per refill (`dali_payload counter`); the arena
+   * payloads need none.
+   */
+  u_char      *ring_data;
+  size_t       ring_data_size;
+
+  /* The (seed, offset) generator seed for counter payloads. */
+  uint64_t     seed;
+
+  /*
+   * Adaptive ring sizing (no explicit `dali_buffers`): the buffer
+   * size this connection has learned so far, the worker-budget
+   * bytes this ring currently has charged, and the high-water
+   * sent-byte count the next drain measurement starts from.
+   */
+  size_t       adapt_size;
+  size_t       charged;
+  off_t        sent_mark;
+  unsigned     adaptive:1;
+
+  /*
+   * Token bucket for paced responses: `tokens` is how many bytes
+   * we may emit right now, refilled from the configured rate by
+   * the wall-clock time since `last_fill`.
+   */
+  size_t       rate;
+  size_t       tokens;
+  ngx_msec_t   last_fill;
+
+  /*
+   * Slow-drip state: one chunk goes out per interval tick. When
+   * `unbounded` is set the response has no configured length and
+   * keeps dripping until the client goes away.
+   */
+  size_t       chunk;
+  ngx_msec_t   interval;
+  unsigned     unbounded:1;
+
+  /*
+   * Mid-body abort fault: when nonzero, the connection is torn
+   * down once this many bytes of the body have been emitted,
+   * while the headers advertised the full length.
+   */
+  size_t       abort_at;
+
+  /*
+   * First-byte delay state: the timer that holds the response
+   * back, and a flag so the delay is only taken once.
+   */
+  ngx_msec_t   delay;
+  ngx_event_t  delay_event;
+  unsigned     delay_done:1;
+
+  /*
+   * Set when this context lives in the connection pool and is
+   * recycled across the requests of a keepalive connection (see
+   * ngx_http_dali_acquire_ctx).
+   */
+  unsigned     conn_cached:1;
+
+  /*
+   * Monotonic timestamps (microseconds) behind the per-request
+   * timing variables: handler entry, body-read completion, and
+   * header send (see ngx_http_dali_add_variables).
+   */
+  uint64_t     t_start;
+  uint64_t     t_body;
+  uint64_t     t_sent;
 };
 typedef struct ngx_http_dali_ctx_s ngx_http_dali_ctx_t;
 
@@ -65,14 +367,290 @@ typedef struct ngx_http_dali_ctx_s ngx_http_dali_ctx_t;
 static void *ngx_http_dali_create_conf(ngx_conf_t *);
 static char *ngx_http_dali_merge_conf(ngx_conf_t *, void *, void *);
 static char *ngx_http_dali_enable(ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_dali_status_enable(ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_dali_set_delay(ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_dali_set_stream(ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_dali_set_fault(ngx_conf_t *, ngx_command_t *, void *);
+static char *ngx_http_dali_set_payload(ngx_conf_t *, ngx_command_t *, void *);
+static size_t ngx_http_dali_payload_slice(ngx_uint_t, size_t, u_char **);
+static void ngx_http_dali_counter_fill(u_char *, size_t, uint64_t, off_t);
+static ngx_int_t ngx_http_dali_add_variables(ngx_conf_t *);
+static ngx_int_t ngx_http_dali_preconfiguration(ngx_conf_t *);
+static ngx_int_t ngx_http_dali_init_module(ngx_cycle_t *);
+static ngx_int_t ngx_http_dali_init_process(ngx_cycle_t *);
+static void ngx_http_dali_exit_process(ngx_cycle_t *);
+static void ngx_http_dali_exit_master(ngx_cycle_t *);
+
+/*
+ * Every response body is carved out of /dev/zero. Rather than
+ * paying an open(2)/close(2) pair on every request, each worker
+ * opens the descriptor once when it starts (see
+ * ngx_http_dali_init_process) and reuses it for the lifetime
+ * of the process.
+ */
+static ngx_str_t ngx_http_dali_dev_zero_path = ngx_string("/dev/zero");
+static ngx_fd_t  ngx_http_dali_dev_zero_fd = NGX_INVALID_FILE;
+
+/*
+ * Memory mode serves response bodies as slices of this arena.
+ * The master maps it once, as anonymous shared memory, in
+ * ngx_http_dali_init_module; every worker then inherits the
+ * mapping across fork and serves from the same physical pages.
+ * One arena's worth of RSS covers the whole worker pool, and the
+ * pages stay hot in the last-level cache no matter which worker
+ * a request lands on. Responses longer than the arena are
+ * emitted as a chain of buffers that all point at the same
+ * region.
+ */
+/*
+ * Default ring-buffer size for responses that stream without an
+ * explicit `dali_buffers` (pacing, and multiplexed protocols).
+ */
+#define NGX_HTTP_DALI_STREAM_BUF_SIZE 65536
+
+/*
+ * Bounds for the adaptive ring sizing used when `dali_buffers` is
+ * not configured: each connection starts at the minimum and the
+ * writer grows or halves the buffer geometrically from the drain
+ * rate it observes between its invocations. The budget caps the
+ * bytes all adaptive rings in one worker may have in flight at
+ * once; connections arriving over it are pinned to the minimum.
+ */
+#define NGX_HTTP_DALI_STREAM_BUF_MIN 4096
+#define NGX_HTTP_DALI_STREAM_BUF_MAX 262144
+#define NGX_HTTP_DALI_STREAM_BUDGET (64 * 1024 * 1024)
+
+/*
+ * How many bytes one write-event invocation may emit before it
+ * yields. A client that keeps draining as fast as we fill (think
+ * loopback) would otherwise hold the worker in the writer loop
+ * for the whole body; past this budget the writer re-posts its
+ * own write event and lets the rest of the event loop run.
+ */
+#define NGX_HTTP_DALI_STREAM_YIELD (2 * 1024 * 1024)
+
+/*
+ * Fault injection (`dali_fault <error|stall|abort> <percent>`).
+ * The directives compile into a fixed schedule table at
+ * configuration time: percent% of its slots carry the fault
+ * kind, scattered by a deterministic PRNG, and the handler
+ * consults it with one masked table load per request -- no
+ * per-request arithmetic beyond a counter increment. A stall
+ * parks the response on the delay timer for an hour, which every
+ * client or proxy timeout fires long before.
+ */
+#define NGX_HTTP_DALI_FAULT_NONE       0
+#define NGX_HTTP_DALI_FAULT_ERROR      1
+#define NGX_HTTP_DALI_FAULT_STALL      2
+#define NGX_HTTP_DALI_FAULT_ABORT      3
+#define NGX_HTTP_DALI_FAULT_TABLE_SIZE 1024
+#define NGX_HTTP_DALI_STALL_MSEC       3600000
+
+#define NGX_HTTP_DALI_ARENA_SIZE (1024 * 1024)
+static u_char   *ngx_http_dali_arena = NULL;
+static ngx_shm_t ngx_http_dali_arena_shm;
+
+/*
+ * The pseudorandom arena for `dali_payload random`. It is only
+ * mapped (and filled, by the master, before the pages are made
+ * read-only) when some location actually asks for random
+ * payloads; configuration merging records that in the flag
+ * below. Slices are served from random offsets in the first half
+ * of the arena so consecutive responses do not repeat
+ * byte-for-byte.
+ */
+static u_char    *ngx_http_dali_random_arena = NULL;
+static ngx_shm_t  ngx_http_dali_random_arena_shm;
+static ngx_uint_t ngx_http_dali_random_arena_wanted = 0;
+
+/*
+ * A small xoshiro256** generator. It is not cryptographic -- it
+ * only has to be fast and produce bytes that do not compress --
+ * and each worker seeds its own state so workers do not emit
+ * identical streams.
+ */
+static uint64_t ngx_http_dali_prng_state[4];
+
+static uint64_t ngx_http_dali_prng_next(void) {
+  uint64_t *s = ngx_http_dali_prng_state;
+  uint64_t x = s[1] * 5;
+  uint64_t result = ((x << 7) | (x >> 57)) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+
+  return result;
+}
+
+/*
+ * The splitmix64 finalizer: a stateless, invertible mix that
+ * turns consecutive inputs into well-distributed outputs. It
+ * spreads the seed over the xoshiro state below, and it is the
+ * (seed, index) -> word function behind `dali_payload counter`.
+ */
+static uint64_t ngx_http_dali_splitmix(uint64_t z) {
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static void ngx_http_dali_prng_seed(uint64_t seed) {
+  ngx_uint_t i;
+
+  for (i = 0; i < 4; i++) {
+    ngx_http_dali_prng_state[i] = ngx_http_dali_splitmix(seed + i);
+  }
+}
+
+/*
+ * Per-worker position in the fault schedules. One counter is
+ * shared by every faulting location; tables are consulted modulo
+ * their (power of two) size, so sharing merely interleaves the
+ * schedules without changing any location's fault rate.
+ */
+static ngx_uint_t ngx_http_dali_fault_seq = 0;
+
+/*
+ * Per-worker total of the bytes the adaptive rings currently have
+ * in flight, measured against NGX_HTTP_DALI_STREAM_BUDGET.
+ */
+static size_t ngx_http_dali_stream_charged = 0;
+
+/*
+ * ngx_http_dali_monotonic_us
+ *
+ * A microsecond monotonic timestamp for the per-request timing
+ * variables. One vDSO clock_gettime call -- no syscall on any
+ * platform we care about -- so it is cheap enough for the hot
+ * path.
+ *
+ * Input: None.
+ * Output: Microseconds on the monotonic clock.
+ */
+static uint64_t ngx_http_dali_monotonic_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/*
+ * Sendfile mode serves responses from a sparse zero file that
+ * each worker creates at startup: anonymous (O_TMPFILE) where the
+ * kernel supports it, otherwise a mkstemp name unlinked the
+ * moment it exists -- never a fixed, predictable path that a
+ * local user could plant a symlink at. The file is truncated to
+ * the largest length configured anywhere, which
+ * ngx_http_dali_enable records here as directives are parsed, so
+ * any configured response fits inside it. Because the file is
+ * sparse, it occupies no disk space and reads as zeros. The
+ * directory it lives in (only its filesystem matters; the file
+ * has no name) comes from `dali_sendfile_dir`, defaulting to
+ * /tmp; the path string below only labels the descriptor in
+ * error logs.
+ */
+static size_t    ngx_http_dali_max_length = 0;
+static ngx_fd_t  ngx_http_dali_sendfile_fd = NGX_INVALID_FILE;
+static ngx_str_t ngx_http_dali_sendfile_path =
+    ngx_string("dali sendfile backing file");
+static ngx_str_t ngx_http_dali_sendfile_dir = ngx_string("/tmp");
+
+/*
+ * Per-module counters that live in a shared-memory zone so every
+ * worker updates the same block with atomic increments and a
+ * `dali_status` location can render fleet-wide numbers without
+ * any log scraping. The histogram buckets responses by the
+ * power of two their length falls under (bucket i counts
+ * responses with 2^(i-1) < length <= 2^i; bucket 0 counts
+ * lengths of zero and one).
+ */
+#define NGX_HTTP_DALI_HISTOGRAM_BUCKETS 64
+
+struct ngx_http_dali_stats_s {
+  ngx_atomic_t requests;
+  ngx_atomic_t bytes;
+  ngx_atomic_t histogram[NGX_HTTP_DALI_HISTOGRAM_BUCKETS];
+};
+typedef struct ngx_http_dali_stats_s ngx_http_dali_stats_t;
+
+static ngx_shm_zone_t *ngx_http_dali_stats_zone = NULL;
+
+#if (NGX_HTTP_GZIP)
+/*
+ * The encoding cache for `dali_precompress`. Configuration
+ * parsing registers each distinct fixed length used by a
+ * precompressing location; each worker then gzips that many
+ * zeros once at startup and requests serve the stored blob.
+ * The table is tiny -- one entry per distinct configured length.
+ */
+#define NGX_HTTP_DALI_ENCODED_MAX 64
+
+struct ngx_http_dali_encoded_s {
+  size_t    length;
+  ngx_str_t gzip;
+};
+typedef struct ngx_http_dali_encoded_s ngx_http_dali_encoded_t;
+
+static ngx_http_dali_encoded_t ngx_http_dali_encoded[NGX_HTTP_DALI_ENCODED_MAX];
+static ngx_uint_t ngx_http_dali_encoded_n = 0;
+#endif
+
+static ngx_conf_enum_t ngx_http_dali_modes[] = {
+    {ngx_string("file"), NGX_HTTP_DALI_MODE_FILE},
+    {ngx_string("memory"), NGX_HTTP_DALI_MODE_MEMORY},
+    {ngx_string("sendfile"), NGX_HTTP_DALI_MODE_SENDFILE},
+    {ngx_string("echo"), NGX_HTTP_DALI_MODE_ECHO},
+    {ngx_null_string, 0}};
 
 /*
  * Specify the configuration options available for the user
  * of this module.
  */
 static ngx_command_t ngx_http_dali_commands[] = {
-    {ngx_string("dali"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+    {ngx_string("dali"),
+     NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1 | NGX_CONF_TAKE2 | NGX_CONF_TAKE3 |
+         NGX_CONF_TAKE4,
      ngx_http_dali_enable, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+    {ngx_string("dali_mode"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_enum_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, mode), &ngx_http_dali_modes},
+    {ngx_string("dali_max_length"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, max_length), NULL},
+    {ngx_string("dali_sendfile_dir"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_str_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, sendfile_dir), NULL},
+    {ngx_string("dali_discard_body"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, discard_body), NULL},
+    {ngx_string("dali_payload"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_dali_set_payload, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+    {ngx_string("dali_buffers"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_conf_set_bufs_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, bufs), NULL},
+    {ngx_string("dali_rate"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+     ngx_conf_set_size_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, rate), NULL},
+    {ngx_string("dali_delay"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE12,
+     ngx_http_dali_set_delay, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+    {ngx_string("dali_stream"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_http_dali_set_stream, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+    {ngx_string("dali_fault"), NGX_HTTP_LOC_CONF | NGX_CONF_TAKE2,
+     ngx_http_dali_set_fault, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
+    {ngx_string("dali_cached_headers"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, cached_headers), NULL},
+    {ngx_string("dali_precompress"), NGX_HTTP_LOC_CONF | NGX_CONF_FLAG,
+     ngx_conf_set_flag_slot, NGX_HTTP_LOC_CONF_OFFSET,
+     offsetof(ngx_http_dali_conf_t, precompress), NULL},
+    {ngx_string("dali_status"), NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+     ngx_http_dali_status_enable, NGX_HTTP_LOC_CONF_OFFSET, 0, NULL},
     ngx_null_command};
 
 /*
@@ -80,7 +658,7 @@ static ngx_command_t ngx_http_dali_commands[] = {
  * many *configuration* phases this module will join.
  */
 static ngx_http_module_t ngx_http_dali_module_ctx = {
-    NULL, /* preconfiguration */
+    ngx_http_dali_preconfiguration, /* preconfiguration */
     NULL, /* postconfiguration */
 
     NULL, /* create main configuration */
@@ -106,68 +684,2241 @@ ngx_module_t ngx_http_dali_module = {
     ngx_http_dali_commands,    /* module directives */
     NGX_HTTP_MODULE,           /* module type */
     NULL,                      /* init master */
-    NULL,                      /* init module */
-    NULL,                      /* init process */
+    ngx_http_dali_init_module, /* init module */
+    ngx_http_dali_init_process, /* init process */
     NULL,                      /* init thread */
     NULL,                      /* exit thread */
-    NULL,                      /* exit process */
-    NULL,                      /* exit master */
+    ngx_http_dali_exit_process, /* exit process */
+    ngx_http_dali_exit_master, /* exit master */
     NGX_MODULE_V1_PADDING};
 
+#if (NGX_HTTP_GZIP)
+/*
+ * ngx_http_dali_compress_entry
+ *
+ * Gzip one registered length's worth of zeros into a worker-local
+ * blob. Runs once per distinct length at worker startup; zeros
+ * compress roughly 1000:1 so even large lengths produce small
+ * blobs quickly. The zero arena is used as the input chunk.
+ *
+ * Input: The cache entry to fill and a log for errors.
+ * Output: NGX_OK if the blob was produced.
+ */
+static ngx_int_t ngx_http_dali_compress_entry(ngx_http_dali_encoded_t *entry,
+                                              ngx_log_t *log) {
+  z_stream zs;
+  u_char *out, *bigger;
+  size_t cap, used, fed, chunk;
+  int zrc, flush;
+
+  cap = entry->length / 256 + 4096;
+  out = ngx_alloc(cap, log);
+  if (!out) {
+    return NGX_ERROR;
+  }
+
+  ngx_memzero(&zs, sizeof(z_stream));
+  /* 15 + 16 asks zlib for a gzip (not raw deflate) wrapper. */
+  if (deflateInit2(&zs, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    ngx_free(out);
+    return NGX_ERROR;
+  }
+
+  used = 0;
+  fed = 0;
+
+  do {
+    chunk = ngx_min(entry->length - fed, (size_t)NGX_HTTP_DALI_ARENA_SIZE);
+    zs.next_in = ngx_http_dali_arena;
+    zs.avail_in = (uInt)chunk;
+    fed += chunk;
+    flush = (fed == entry->length) ? Z_FINISH : Z_NO_FLUSH;
+
+    do {
+      if (used == cap) {
+        bigger = ngx_alloc(cap * 2, log);
+        if (!bigger) {
+          deflateEnd(&zs);
+          ngx_free(out);
+          return NGX_ERROR;
+        }
+        ngx_memcpy(bigger, out, used);
+        ngx_free(out);
+        out = bigger;
+        cap *= 2;
+      }
+
+      zs.next_out = out + used;
+      zs.avail_out = (uInt)(cap - used);
+      zrc = deflate(&zs, flush);
+      if (zrc == Z_STREAM_ERROR) {
+        deflateEnd(&zs);
+        ngx_free(out);
+        return NGX_ERROR;
+      }
+      used = (size_t)(zs.next_out - out);
+    } while (zs.avail_out == 0);
+  } while (flush != Z_FINISH);
+
+  deflateEnd(&zs);
+
+  entry->gzip.data = out;
+  entry->gzip.len = used;
+  return NGX_OK;
+}
+#endif
 
 /*
- * This callback function will be invoked when the pool
- * associated with the connection is cleaned up.
+ * ngx_http_dali_init_module
+ *
+ * Runs once in the master, after the configuration is parsed.
+ * Map the payload arenas as anonymous shared memory so every
+ * worker forked afterwards serves from the same physical pages:
+ * one arena's worth of RSS for the whole worker pool, and the
+ * pages stay hot in the last-level cache no matter which worker
+ * a request lands on. The random arena is filled here, once, and
+ * then made read-only before any worker can see it. On reload
+ * the previous cycle's mappings are released first; workers from
+ * the old cycle keep their inherited references until they exit.
  *
- * See (below) for where/how it is installed.
+ * Input: The cycle being initialized.
+ * Output: NGX_OK if the arenas could be mapped.
  */
-static void ngx_http_dali_cleanup(void *data) {
-  ngx_http_dali_ctx_t *dali_ctx = (ngx_http_dali_ctx_t*)data;
-  ngx_close_file(dali_ctx->dev_zero_fd);
+static ngx_int_t ngx_http_dali_init_module(ngx_cycle_t *cycle) {
+  if (ngx_http_dali_arena) {
+    ngx_shm_free(&ngx_http_dali_arena_shm);
+    ngx_http_dali_arena = NULL;
+  }
+  if (ngx_http_dali_random_arena) {
+    ngx_shm_free(&ngx_http_dali_random_arena_shm);
+    ngx_http_dali_random_arena = NULL;
+  }
+
+  /*
+   * Anonymous shared pages arrive zero-filled, which is exactly
+   * the content memory mode serves; the arena is never written.
+   */
+  ngx_http_dali_arena_shm.size = NGX_HTTP_DALI_ARENA_SIZE;
+  ngx_str_set(&ngx_http_dali_arena_shm.name, "dali_zero_arena");
+  ngx_http_dali_arena_shm.log = cycle->log;
+  if (ngx_shm_alloc(&ngx_http_dali_arena_shm) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ngx_http_dali_arena = ngx_http_dali_arena_shm.addr;
+
+  if (ngx_http_dali_random_arena_wanted) {
+    uint64_t *word;
+    ngx_uint_t i;
+
+    ngx_http_dali_random_arena_shm.size = NGX_HTTP_DALI_ARENA_SIZE;
+    ngx_str_set(&ngx_http_dali_random_arena_shm.name, "dali_random_arena");
+    ngx_http_dali_random_arena_shm.log = cycle->log;
+    if (ngx_shm_alloc(&ngx_http_dali_random_arena_shm) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    ngx_http_dali_random_arena = ngx_http_dali_random_arena_shm.addr;
+
+    /*
+     * Fill the arena with a straight run of 8-byte PRNG stores --
+     * a loop the compiler is free to unroll and vectorize -- so
+     * request handling never generates a byte. Workers reseed
+     * for their own draws, so seeding here costs nothing.
+     */
+    ngx_http_dali_prng_seed(((uint64_t)ngx_pid << 32) ^ (uint64_t)ngx_time());
+    word = (uint64_t *)ngx_http_dali_random_arena;
+    for (i = 0; i < NGX_HTTP_DALI_ARENA_SIZE / sizeof(uint64_t); i++) {
+      word[i] = ngx_http_dali_prng_next();
+    }
+
+    /*
+     * Nothing writes the arena after this point; dropping write
+     * permission makes the sharing contract enforceable.
+     */
+    if (mprotect(ngx_http_dali_random_arena, NGX_HTTP_DALI_ARENA_SIZE,
+                 PROT_READ) != 0) {
+      ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                    "Dali could not write-protect the random-payload arena");
+    }
+  }
+
+  return NGX_OK;
 }
 
-static void ngx_http_dali_client_body_fetched_handler(ngx_http_request_t *r) {
-  ngx_int_t ngx_send_header_rc = NGX_OK;
-  ngx_http_dali_ctx_t *dali_ctx = NULL;
+/*
+ * ngx_http_dali_init_process
+ *
+ * Runs once in each worker as it starts. Open the /dev/zero
+ * descriptor that every request handled by this worker will
+ * share. Doing this here (rather than per request) saves two
+ * syscalls per hit and keeps us clear of fd-limit pressure.
+ *
+ * Input: The cycle for the starting worker.
+ * Output: NGX_OK if the descriptor could be opened; NGX_ERROR
+ * otherwise (which stops the worker from starting).
+ */
+static ngx_int_t ngx_http_dali_init_process(ngx_cycle_t *cycle) {
+  ngx_http_dali_dev_zero_fd = ngx_open_file(
+      ngx_http_dali_dev_zero_path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if (ngx_http_dali_dev_zero_fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                  "Dali could not open /dev/zero at worker startup");
+    return NGX_ERROR;
+  }
 
-  dali_ctx = ngx_http_get_module_ctx(r, ngx_http_dali_module);
-  if (!dali_ctx) {
-    ngx_log_error(
-        NGX_LOG_CRIT, r->connection->log, 0,
-        "Dali could not retrieve the Dali context");
-    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-    return;
+  /*
+   * The payload arenas were mapped by the master in
+   * ngx_http_dali_init_module and arrive here through fork; this
+   * worker only needs its own PRNG seed, for delay jitter and
+   * random-slice offset selection.
+   */
+  ngx_http_dali_prng_seed(((uint64_t)ngx_pid << 32) ^ (uint64_t)ngx_time());
+
+  /*
+   * Create the sparse backing file for sendfile mode, sized to
+   * the largest length seen during configuration parsing. The
+   * file is unlinked as soon as it is open, so it lives exactly
+   * as long as the descriptor does and leaves nothing behind if
+   * the worker dies. Since it is never written, every page the
+   * kernel sends from it is a hole -- i.e., zeros -- and the
+   * transfer happens without any copy through user space.
+   */
+  if (ngx_http_dali_max_length > 0) {
+#ifdef O_TMPFILE
+    /*
+     * An anonymous file never has a name, so there is no
+     * predictable path for a local user to plant a symlink at and
+     * have the ftruncate below redirected to their target.
+     */
+    ngx_http_dali_sendfile_fd =
+        open((const char *)ngx_http_dali_sendfile_dir.data,
+             O_TMPFILE | O_RDWR, 0600);
+#endif
+
+    /*
+     * Kernels or filesystems without O_TMPFILE get a unique
+     * mkstemp name instead, unlinked as soon as it exists.
+     */
+    if (ngx_http_dali_sendfile_fd == NGX_INVALID_FILE &&
+        ngx_http_dali_sendfile_dir.len +
+                sizeof("/ngx_http_dali_sendfile.XXXXXX") <=
+            NGX_MAX_PATH) {
+      u_char name[NGX_MAX_PATH];
+
+      ngx_snprintf(name, NGX_MAX_PATH - 1,
+                   "%V/ngx_http_dali_sendfile.XXXXXX%Z",
+                   &ngx_http_dali_sendfile_dir);
+      ngx_http_dali_sendfile_fd = mkstemp((char *)name);
+      if (ngx_http_dali_sendfile_fd != NGX_INVALID_FILE) {
+        (void)ngx_delete_file(name);
+      }
+    }
+
+    if (ngx_http_dali_sendfile_fd == NGX_INVALID_FILE) {
+      ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                    "Dali could not create the sendfile backing file in \"%V\"",
+                    &ngx_http_dali_sendfile_dir);
+      return NGX_ERROR;
+    }
+    if (ftruncate(ngx_http_dali_sendfile_fd,
+                  (off_t)ngx_http_dali_max_length) != 0) {
+      ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                    "Dali could not size the sendfile backing file");
+      return NGX_ERROR;
+    }
   }
 
-  ngx_str_set(&r->headers_out.content_type, "application/octet-stream");
+#if (NGX_HTTP_GZIP)
+  /*
+   * Build the gzip blob for every length registered by a
+   * dali_precompress location, so serving one is just a header
+   * and a pointer at request time.
+   */
+  {
+    ngx_uint_t i;
 
-  ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, "Dali module responding");
+    for (i = 0; i < ngx_http_dali_encoded_n; i++) {
+      if (ngx_http_dali_encoded[i].gzip.data) {
+        continue;
+      }
+      if (ngx_http_dali_compress_entry(&ngx_http_dali_encoded[i],
+                                       cycle->log) != NGX_OK) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "Dali could not precompress a %uz byte payload",
+                      ngx_http_dali_encoded[i].length);
+        return NGX_ERROR;
+      }
+    }
+  }
+#endif
 
-  ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0,
-                "Dali sending a %d byte response", dali_ctx->length);
+  return NGX_OK;
+}
 
-  r->headers_out.content_length_n = dali_ctx->length;
-  r->headers_out.status = NGX_HTTP_OK;
-  r->connection->sendfile = 0;
+/*
+ * ngx_http_dali_exit_process
+ *
+ * Runs once in each worker as it shuts down. Close the
+ * per-worker /dev/zero descriptor opened by
+ * ngx_http_dali_init_process.
+ *
+ * Input: The cycle for the exiting worker.
+ * Output: None.
+ */
+static void ngx_http_dali_exit_process(ngx_cycle_t *cycle) {
+  if (ngx_http_dali_dev_zero_fd != NGX_INVALID_FILE) {
+    ngx_close_file(ngx_http_dali_dev_zero_fd);
+    ngx_http_dali_dev_zero_fd = NGX_INVALID_FILE;
+  }
+  if (ngx_http_dali_sendfile_fd != NGX_INVALID_FILE) {
+    ngx_close_file(ngx_http_dali_sendfile_fd);
+    ngx_http_dali_sendfile_fd = NGX_INVALID_FILE;
+  }
+#if (NGX_HTTP_GZIP)
+  {
+    ngx_uint_t i;
 
-  ngx_send_header_rc = ngx_http_send_header(r);
-  if (ngx_send_header_rc == NGX_ERROR) {
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                  "Dali could not send the response header");
-    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-    return;
+    for (i = 0; i < ngx_http_dali_encoded_n; i++) {
+      if (ngx_http_dali_encoded[i].gzip.data) {
+        ngx_free(ngx_http_dali_encoded[i].gzip.data);
+        ngx_http_dali_encoded[i].gzip.data = NULL;
+        ngx_http_dali_encoded[i].gzip.len = 0;
+      }
+    }
   }
+#endif
+}
 
-  if (ngx_send_header_rc > NGX_OK || r->header_only) {
-    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-    return;
+/*
+ * ngx_http_dali_exit_master
+ *
+ * Release the shared payload arenas mapped by
+ * ngx_http_dali_init_module as the master shuts down.
+ *
+ * Input: The cycle for the exiting master.
+ * Output: None.
+ */
+static void ngx_http_dali_exit_master(ngx_cycle_t *cycle) {
+  (void)cycle;
+
+  if (ngx_http_dali_arena) {
+    ngx_shm_free(&ngx_http_dali_arena_shm);
+    ngx_http_dali_arena = NULL;
+  }
+  if (ngx_http_dali_random_arena) {
+    ngx_shm_free(&ngx_http_dali_random_arena_shm);
+    ngx_http_dali_random_arena = NULL;
+  }
+}
+
+/*
+ * ngx_http_dali_init_stats_zone
+ *
+ * Initialize (or re-attach to, across reloads) the shared-memory
+ * block that holds the module-wide counters.
+ *
+ * Input: The zone being initialized and the previous cycle's
+ * data, if any.
+ * Output: NGX_OK if the counter block is usable.
+ */
+static ngx_int_t ngx_http_dali_init_stats_zone(ngx_shm_zone_t *zone,
+                                               void *data) {
+  ngx_slab_pool_t *slab;
+  ngx_http_dali_stats_t *stats;
+
+  if (data) {
+    /* Reload: carry the counters over from the old cycle. */
+    zone->data = data;
+    return NGX_OK;
+  }
+
+  slab = (ngx_slab_pool_t *)zone->shm.addr;
+
+  if (zone->shm.exists) {
+    zone->data = slab->data;
+    return NGX_OK;
+  }
+
+  stats = ngx_slab_calloc(slab, sizeof(ngx_http_dali_stats_t));
+  if (!stats) {
+    return NGX_ERROR;
+  }
+
+  slab->data = stats;
+  zone->data = stats;
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_add_stats_zone
+ *
+ * Make sure the shared counter zone exists. Called while parsing
+ * any directive that needs the counters; ngx_shared_memory_add
+ * hands back the same zone on repeated calls.
+ *
+ * Input: The configuration being parsed.
+ * Output: NGX_OK if the zone is registered.
+ */
+static ngx_int_t ngx_http_dali_add_stats_zone(ngx_conf_t *cf) {
+  ngx_str_t name = ngx_string("dali_stats");
+
+  ngx_http_dali_stats_zone = ngx_shared_memory_add(
+      cf, &name, 16 * ngx_pagesize, &ngx_http_dali_module);
+  if (!ngx_http_dali_stats_zone) {
+    return NGX_ERROR;
+  }
+  ngx_http_dali_stats_zone->init = ngx_http_dali_init_stats_zone;
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_account
+ *
+ * Record a served response in the shared counters: one request,
+ * its byte count, and a histogram tick in the power-of-two
+ * bucket its length falls under. All updates are single atomic
+ * increments, so this is safe from every worker at once and
+ * cheap enough for the hot path.
+ *
+ * Input: The length of the response that was just sent.
+ * Output: None.
+ */
+static void ngx_http_dali_account(size_t length) {
+  ngx_http_dali_stats_t *stats;
+  ngx_uint_t bucket;
+  size_t remaining;
+
+  if (!ngx_http_dali_stats_zone || !ngx_http_dali_stats_zone->data) {
+    return;
+  }
+  stats = ngx_http_dali_stats_zone->data;
+
+  ngx_atomic_fetch_add(&stats->requests, 1);
+  ngx_atomic_fetch_add(&stats->bytes, length);
+
+  bucket = 0;
+  for (remaining = length; remaining > 1; remaining >>= 1) {
+    bucket++;
+  }
+  if (bucket > 0 && ((size_t)1 << bucket) < length) {
+    bucket++;
+  }
+  if (bucket >= NGX_HTTP_DALI_HISTOGRAM_BUCKETS) {
+    bucket = NGX_HTTP_DALI_HISTOGRAM_BUCKETS - 1;
+  }
+  ngx_atomic_fetch_add(&stats->histogram[bucket], 1);
+}
+
+/*
+ * ngx_http_dali_multiplexed
+ *
+ * Whether this request arrived over a multiplexed protocol (h2
+ * or h3). Their framing layers slice output into frames and
+ * interleave streams, and feeding them one giant buffer makes
+ * them buffer and re-fragment it; such requests are better off
+ * on the streaming path with frame-aligned buffers.
+ *
+ * Input: Information about the request being satisfied.
+ * Output: Nonzero when the request is h2 or h3.
+ */
+static ngx_uint_t ngx_http_dali_multiplexed(ngx_http_request_t *r) {
+#if (NGX_HTTP_V2)
+  if (r->stream) {
+    return 1;
+  }
+#endif
+#if (NGX_HTTP_V3)
+  if (r->http_version == NGX_HTTP_VERSION_30) {
+    return 1;
+  }
+#endif
+  (void)r;
+  return 0;
+}
+
+/*
+ * ngx_http_dali_stream_uncharge
+ *
+ * Hand a streamed response's window back to the worker's adaptive
+ * buffer budget. Idempotent, since the same context can reach
+ * this through normal completion, connection teardown, or the
+ * keepalive reset, whichever comes first.
+ *
+ * Input: The Dali context holding the charge.
+ * Output: None.
+ */
+static void ngx_http_dali_stream_uncharge(ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_http_dali_stream_charged -= dali_ctx->charged;
+  dali_ctx->charged = 0;
+}
+
+/*
+ * ngx_http_dali_stream_uncharge_cleanup
+ *
+ * Pool-cleanup wrapper around the above, registered for contexts
+ * that do not live in the connection pool (subrequests), so a
+ * client vanishing mid-stream still returns the charge.
+ *
+ * Input: The Dali context holding the charge.
+ * Output: None.
+ */
+static void ngx_http_dali_stream_uncharge_cleanup(void *data) {
+  ngx_http_dali_stream_uncharge(data);
+}
+
+/*
+ * ngx_http_dali_stream_init
+ *
+ * Prepare the reusable buffer ring for a response that will be
+ * streamed rather than emitted in one shot. The ring buffers and
+ * their chain links are allocated once here (bounded by the
+ * configured count) and then recycled for the whole response.
+ *
+ * Input: Information about the request being satisfied.
+ *        The configuration for the matched location.
+ *        The Dali context for that request.
+ * Output: NGX_OK if the ring could be set up; NGX_ERROR otherwise.
+ */
+static ngx_int_t ngx_http_dali_stream_init(ngx_http_request_t *r,
+                                           ngx_http_dali_conf_t *conf,
+                                           ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_uint_t i;
+  ngx_uint_t num;
+  ngx_buf_t *buffer;
+
+  /*
+   * A response can stream even when `dali_buffers` was not
+   * configured (pacing, multiplexed protocols, large counter
+   * bodies). Rather than one fixed fallback size -- too big for a
+   * throttled client, too small for a 10 Gb/s one -- such rings
+   * size themselves: a connection starts at the minimum and the
+   * writer adjusts it geometrically from the drain rate it
+   * observes, so whatever this connection learned on an earlier
+   * request carries over here. Paced and drip responses keep the
+   * fixed default, since their buffer size is dictated by the
+   * pacing math, not by the connection.
+   */
+  num = conf->bufs.num ? conf->bufs.num : 2;
+  if (conf->bufs.num) {
+    dali_ctx->ring_buf_size = conf->bufs.size;
+  } else if (conf->rate > 0 || dali_ctx->interval > 0) {
+    dali_ctx->ring_buf_size = NGX_HTTP_DALI_STREAM_BUF_SIZE;
+  } else {
+    if (dali_ctx->adapt_size == 0) {
+      dali_ctx->adapt_size = NGX_HTTP_DALI_STREAM_BUF_MIN;
+    }
+    dali_ctx->ring_buf_size = dali_ctx->adapt_size;
+    dali_ctx->adaptive = 1;
+  }
+
+#if (NGX_HTTP_V2)
+  /*
+   * On HTTP/2 connections, round the buffer size to a multiple of
+   * the negotiated frame size so each buffer shears cleanly into
+   * whole DATA frames; otherwise every buffer boundary leaves a
+   * runt frame and the h2 layer re-fragments across it.
+   */
+  if (r->stream) {
+    size_t frame_size = r->stream->connection->frame_size;
+
+    if (frame_size > 0) {
+      if (dali_ctx->ring_buf_size < frame_size) {
+        dali_ctx->ring_buf_size = frame_size;
+      } else {
+        dali_ctx->ring_buf_size -= dali_ctx->ring_buf_size % frame_size;
+      }
+    }
+  }
+#endif
+
+  /*
+   * Slow-drip responses emit exactly one chunk per tick, so the
+   * buffer is the chunk.
+   */
+  if (dali_ctx->interval > 0 && dali_ctx->chunk > 0) {
+    dali_ctx->ring_buf_size = dali_ctx->chunk;
+  }
+
+  if (dali_ctx->mode == NGX_HTTP_DALI_MODE_MEMORY &&
+      dali_ctx->ring_buf_size > NGX_HTTP_DALI_ARENA_SIZE) {
+    dali_ctx->ring_buf_size = NGX_HTTP_DALI_ARENA_SIZE;
+  }
+
+  /*
+   * Charge this ring's window against the worker budget. A worker
+   * already at the budget pins newcomers to the minimum rather
+   * than refusing them; the slight overshoot that allows is the
+   * price of never failing a request over buffer accounting.
+   */
+  if (dali_ctx->adaptive) {
+    size_t want = num * dali_ctx->ring_buf_size;
+
+    if (ngx_http_dali_stream_charged + want > NGX_HTTP_DALI_STREAM_BUDGET) {
+      dali_ctx->ring_buf_size = NGX_HTTP_DALI_STREAM_BUF_MIN;
+      dali_ctx->adapt_size = NGX_HTTP_DALI_STREAM_BUF_MIN;
+      want = num * dali_ctx->ring_buf_size;
+    }
+
+    if (!dali_ctx->conn_cached) {
+      ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(r->pool, 0);
+
+      if (!cln) {
+        return NGX_ERROR;
+      }
+      cln->handler = ngx_http_dali_stream_uncharge_cleanup;
+      cln->data = dali_ctx;
+    }
+
+    ngx_http_dali_stream_charged += want;
+    dali_ctx->charged = want;
+  }
+
+  /*
+   * Connection-cached contexts keep their ring across requests,
+   * so on a hot keepalive connection the arrays below are only
+   * ever allocated once. They come from the connection pool in
+   * that case, since they must outlive any one request.
+   */
+  if (!dali_ctx->conn_cached || dali_ctx->ring_capacity < num) {
+    ngx_pool_t *pool = dali_ctx->conn_cached ? r->connection->pool : r->pool;
+
+    dali_ctx->ring_bufs = ngx_pcalloc(pool, num * sizeof(ngx_buf_t));
+    dali_ctx->ring_links = ngx_pcalloc(pool, num * sizeof(ngx_chain_t));
+    if (!dali_ctx->ring_bufs || !dali_ctx->ring_links) {
+      return NGX_ERROR;
+    }
+    dali_ctx->ring_capacity = num;
+  }
+
+  if (dali_ctx->mode != NGX_HTTP_DALI_MODE_MEMORY) {
+    if (dali_ctx->mode == NGX_HTTP_DALI_MODE_SENDFILE) {
+      dali_ctx->file.fd = ngx_http_dali_sendfile_fd;
+      dali_ctx->file.name = ngx_http_dali_sendfile_path;
+    } else {
+      dali_ctx->file.fd = ngx_http_dali_dev_zero_fd;
+      dali_ctx->file.name = ngx_http_dali_dev_zero_path;
+    }
+    if (dali_ctx->file.fd == NGX_INVALID_FILE) {
+      return NGX_ERROR;
+    }
+    dali_ctx->file.log = r->connection->log;
+    dali_ctx->file.directio = false;
+  } else if (dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_COUNTER) {
+    /*
+     * Counter payloads are generated into the ring rather than
+     * served out of a shared arena, so each ring buffer needs
+     * writable backing of its own. Like the ring arrays above,
+     * the backing store survives on the connection pool for
+     * connection-cached contexts and is only regrown when a
+     * larger ring shows up.
+     */
+    size_t need = num * dali_ctx->ring_buf_size;
+
+    if (!dali_ctx->ring_data || dali_ctx->ring_data_size < need) {
+      ngx_pool_t *pool = dali_ctx->conn_cached ? r->connection->pool : r->pool;
+
+      dali_ctx->ring_data = ngx_palloc(pool, need);
+      if (!dali_ctx->ring_data) {
+        return NGX_ERROR;
+      }
+      dali_ctx->ring_data_size = need;
+    }
+  } else if (dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_RANDOM
+                 ? !ngx_http_dali_random_arena
+                 : !ngx_http_dali_arena) {
+    return NGX_ERROR;
+  }
+
+  /*
+   * Every ring buffer starts out drained (zero size) so the
+   * first fill pass claims all of them.
+   */
+  for (i = 0; i < num; i++) {
+    buffer = &dali_ctx->ring_bufs[i];
+    *buffer = conf->buffer_template;
+    buffer->last_buf = 0;
+    buffer->last_in_chain = 0;
+    buffer->tag = (ngx_buf_tag_t)&ngx_http_dali_module;
+    if (dali_ctx->mode != NGX_HTTP_DALI_MODE_MEMORY) {
+      buffer->file = &dali_ctx->file;
+    } else if (dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_COUNTER) {
+      buffer->start = dali_ctx->ring_data + i * dali_ctx->ring_buf_size;
+      buffer->end = buffer->start + dali_ctx->ring_buf_size;
+      buffer->pos = buffer->start;
+      buffer->last = buffer->start;
+    }
+  }
+
+  dali_ctx->ring_size = num;
+  dali_ctx->remaining = dali_ctx->length;
+  dali_ctx->offset = 0;
+
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_rate_refill
+ *
+ * Top up the request's token bucket from the time elapsed since
+ * the last refill, capped at one second's worth of burst.
+ *
+ * Input: The Dali context for the request being paced.
+ * Output: Zero when enough tokens are available to emit the next
+ * chunk now, otherwise how many milliseconds to sleep (via an
+ * event timer) until there will be.
+ */
+static ngx_msec_t ngx_http_dali_rate_refill(ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_msec_t now;
+  ngx_msec_t elapsed;
+  size_t target;
+
+  now = ngx_current_msec;
+  elapsed = now - dali_ctx->last_fill;
+  dali_ctx->last_fill = now;
+
+  dali_ctx->tokens += dali_ctx->rate * elapsed / 1000;
+  if (dali_ctx->tokens > dali_ctx->rate) {
+    dali_ctx->tokens = dali_ctx->rate;
+  }
+
+  /*
+   * An unbounded stream never runs out of body, so only a
+   * bounded response that has emitted everything is exempt from
+   * pacing (it has nothing left to pace).
+   */
+  if (dali_ctx->remaining == 0 && !dali_ctx->unbounded) {
+    return 0;
+  }
+
+  /*
+   * Wake up once there are tokens for the next chunk, but never
+   * sleep past 100 ms worth of data so slow rates still tick
+   * smoothly instead of bursting.
+   */
+  target = dali_ctx->unbounded
+               ? dali_ctx->ring_buf_size
+               : ngx_min(dali_ctx->remaining, dali_ctx->ring_buf_size);
+  if (target > dali_ctx->rate / 10 + 1) {
+    target = dali_ctx->rate / 10 + 1;
+  }
+
+  if (dali_ctx->tokens >= target) {
+    return 0;
+  }
+
+  return (ngx_msec_t)((target - dali_ctx->tokens) * 1000 / dali_ctx->rate) + 1;
+}
+
+/*
+ * ngx_http_dali_stream_fill
+ *
+ * Refill every drained ring buffer with the next slice of the
+ * response and link the refilled buffers into a chain for the
+ * output filter. Buffers still in flight (the output filter has
+ * not consumed them yet) are left alone.
+ *
+ * Input: The Dali context for the request being satisfied.
+ * Output: The chain of refilled buffers, or NULL when every
+ * buffer is still in flight (or nothing remains to send).
+ */
+static ngx_chain_t *ngx_http_dali_stream_fill(ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_uint_t i;
+  size_t portion;
+  ngx_buf_t *buffer;
+  ngx_chain_t *link;
+  ngx_chain_t *head = NULL;
+  ngx_chain_t **rest = &head;
+
+  for (i = 0; i < dali_ctx->ring_size &&
+              (dali_ctx->remaining > 0 || dali_ctx->unbounded);
+       i++) {
+    buffer = &dali_ctx->ring_bufs[i];
+    if (ngx_buf_size(buffer) > 0) {
+      continue;
+    }
+
+    portion = dali_ctx->unbounded
+                  ? dali_ctx->ring_buf_size
+                  : ngx_min(dali_ctx->remaining, dali_ctx->ring_buf_size);
+
+    /*
+     * An abort fault stops emitting at the abort point; the
+     * writer then drops the connection with the body short.
+     */
+    if (dali_ctx->abort_at > 0) {
+      size_t until = dali_ctx->abort_at > (size_t)dali_ctx->offset
+                         ? dali_ctx->abort_at - (size_t)dali_ctx->offset
+                         : 0;
+
+      portion = ngx_min(portion, until);
+      if (portion == 0) {
+        break;
+      }
+    }
+
+    /*
+     * A paced response may only emit what the token bucket will
+     * pay for; a partial buffer is fine.
+     */
+    if (dali_ctx->rate > 0) {
+      portion = ngx_min(portion, dali_ctx->tokens);
+      if (portion == 0) {
+        break;
+      }
+    }
+
+    if (dali_ctx->mode == NGX_HTTP_DALI_MODE_MEMORY) {
+      if (dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_COUNTER) {
+        /*
+         * Counter bytes are a pure function of (seed, offset), so
+         * each refill regenerates its slice in place and resuming
+         * mid-body stays consistent with what went before.
+         */
+        ngx_http_dali_counter_fill(buffer->start, portion, dali_ctx->seed,
+                                   dali_ctx->offset);
+        buffer->pos = buffer->start;
+        buffer->last = buffer->start + portion;
+      } else {
+        u_char *base;
+
+        portion =
+            ngx_http_dali_payload_slice(dali_ctx->payload, portion, &base);
+        buffer->pos = base;
+        buffer->last = base + portion;
+        buffer->start = buffer->pos;
+        buffer->end = buffer->last;
+      }
+    } else {
+      buffer->file_pos = dali_ctx->offset;
+      buffer->file_last = dali_ctx->offset + portion;
+    }
+
+    if (dali_ctx->rate > 0) {
+      dali_ctx->tokens -= portion;
+    }
+    if (!dali_ctx->unbounded) {
+      dali_ctx->remaining -= portion;
+    }
+    dali_ctx->offset += portion;
+
+    buffer->flush = 1;
+    if (!dali_ctx->unbounded && dali_ctx->remaining == 0) {
+      buffer->last_buf = 1;
+      buffer->last_in_chain = 1;
+    }
+
+    link = &dali_ctx->ring_links[i];
+    link->buf = buffer;
+    link->next = NULL;
+    *rest = link;
+    rest = &link->next;
+
+    /* A drip tick emits one chunk, not the whole ring. */
+    if (dali_ctx->interval > 0) {
+      break;
+    }
+  }
+
+  return head;
+}
+
+/*
+ * ngx_http_dali_stream_adapt
+ *
+ * Resize an adaptive ring from the drain rate observed since the
+ * writer last ran. The signal is how many bytes the output filter
+ * consumed between two invocations: a client that drained the
+ * whole window was held back by us, so the buffer doubles (while
+ * the worker budget allows); one that drained less than a quarter
+ * of a single buffer is slow enough that the window halves and
+ * the memory goes back to the budget. Counter-payload rings defer
+ * a grow decision to the next response on the connection, since
+ * their buffers slice a backing allocation at a fixed stride that
+ * cannot be restrided while buffers are in flight.
+ *
+ * Input: The Dali context for the request being streamed.
+ * Output: None.
+ */
+static void ngx_http_dali_stream_adapt(ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_uint_t i;
+  size_t in_flight = 0;
+  size_t drained;
+  size_t resized;
+  size_t delta;
+  off_t sent;
+
+  for (i = 0; i < dali_ctx->ring_size; i++) {
+    in_flight += ngx_buf_size(&dali_ctx->ring_bufs[i]);
+  }
+
+  sent = dali_ctx->offset - (off_t)in_flight;
+  drained = (size_t)(sent - dali_ctx->sent_mark);
+  dali_ctx->sent_mark = sent;
+
+  if (drained >= dali_ctx->ring_size * dali_ctx->ring_buf_size &&
+      dali_ctx->ring_buf_size < NGX_HTTP_DALI_STREAM_BUF_MAX) {
+    resized = dali_ctx->ring_buf_size * 2;
+
+    dali_ctx->adapt_size = resized;
+    if (dali_ctx->mode == NGX_HTTP_DALI_MODE_MEMORY &&
+        dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_COUNTER) {
+      return;
+    }
+
+    delta = dali_ctx->ring_size * (resized - dali_ctx->ring_buf_size);
+
+    if (ngx_http_dali_stream_charged + delta > NGX_HTTP_DALI_STREAM_BUDGET) {
+      dali_ctx->adapt_size = dali_ctx->ring_buf_size;
+      return;
+    }
+
+    ngx_http_dali_stream_charged += delta;
+    dali_ctx->charged += delta;
+    dali_ctx->ring_buf_size = resized;
+    return;
+  }
+
+  if (drained * 4 < dali_ctx->ring_buf_size &&
+      dali_ctx->ring_buf_size > NGX_HTTP_DALI_STREAM_BUF_MIN) {
+    resized = dali_ctx->ring_buf_size / 2;
+
+    delta = dali_ctx->ring_size * (dali_ctx->ring_buf_size - resized);
+
+    ngx_http_dali_stream_charged -= delta;
+    dali_ctx->charged -= delta;
+    dali_ctx->ring_buf_size = resized;
+    dali_ctx->adapt_size = resized;
+  }
+}
+
+/*
+ * ngx_http_dali_stream_writer
+ *
+ * The write-event handler that keeps a streamed response moving:
+ * each time the connection can take more data, refill the drained
+ * ring buffers and push them into the output filter, looping
+ * until the socket refuses more or a timer guarantees the next
+ * wakeup. When the last slice has been flushed, finalize the
+ * request (balancing the reference taken when streaming began).
+ *
+ * Input: Information about the request being satisfied.
+ * Output: None.
+ */
+static void ngx_http_dali_stream_writer(ngx_http_request_t *r) {
+  ngx_int_t rc;
+  ngx_msec_t delay;
+  ngx_chain_t *out;
+  off_t start_offset;
+  ngx_connection_t *c = r->connection;
+  ngx_event_t *wev = c->write;
+  ngx_http_dali_ctx_t *dali_ctx;
+  ngx_http_core_loc_conf_t *clcf;
+
+  /*
+   * A timer firing on the write event is either our own pacing
+   * delay expiring (delayed is set; carry on) or the client
+   * genuinely stalling past send_timeout (give up).
+   */
+  if (wev->timedout) {
+    if (wev->delayed) {
+      wev->timedout = 0;
+      wev->delayed = 0;
+    } else {
+      c->timedout = 1;
+      ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+      return;
+    }
+  }
+
+  dali_ctx = ngx_http_get_module_ctx(r, ngx_http_dali_module);
+  if (!dali_ctx) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  /*
+   * With `aio threads` configured, the copy filter reads our
+   * file-backed buffers on a thread pool and re-invokes this
+   * handler when the read completes. While such a read is in
+   * flight, do not push more data into the filter chain.
+   */
+  if (r->aio) {
+    return;
+  }
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  start_offset = dali_ctx->offset;
+
+  /*
+   * Keep refilling and pushing until the socket refuses more data
+   * or a timer guarantees the next wakeup. A single pass is not
+   * enough: write events are registered edge-triggered on the
+   * epoll backend (and the level-triggered ones delete an event
+   * that never blocked), so a client that drains the whole ring
+   * synchronously would never raise another write event and the
+   * transfer would freeze mid-body.
+   */
+  for ( ;; ) {
+    if (dali_ctx->rate > 0) {
+      delay = ngx_http_dali_rate_refill(dali_ctx);
+      if (delay > 0) {
+        wev->delayed = 1;
+        ngx_add_timer(wev, delay);
+        break;
+      }
+    }
+
+    if (dali_ctx->adaptive) {
+      ngx_http_dali_stream_adapt(dali_ctx);
+    }
+
+    out = ngx_http_dali_stream_fill(dali_ctx);
+    rc = ngx_http_output_filter(r, out);
+    if (rc == NGX_ERROR) {
+      ngx_http_finalize_request(r, rc);
+      return;
+    }
+
+    /*
+     * The copy filter may have taken the buffers to a thread
+     * pool mid-loop; its completion re-enters this handler.
+     */
+    if (r->aio) {
+      return;
+    }
+
+    if (dali_ctx->abort_at > 0 &&
+        (size_t)dali_ctx->offset >= dali_ctx->abort_at) {
+      /*
+       * Mid-body abort fault: the advertised length was never
+       * going to arrive. Mark the connection errored so nothing
+       * tries to reuse it, and tear it down.
+       */
+      c->error = 1;
+      ngx_http_dali_stream_uncharge(dali_ctx);
+      ngx_http_finalize_request(r, NGX_ERROR);
+      return;
+    }
+
+    if (dali_ctx->remaining == 0 && !dali_ctx->unbounded && rc == NGX_OK) {
+      ngx_http_dali_probe2(finalize, r, rc);
+      ngx_http_dali_stream_uncharge(dali_ctx);
+      ngx_http_finalize_request(r, rc);
+      return;
+    }
+
+    if (dali_ctx->interval > 0 && rc != NGX_AGAIN) {
+      /*
+       * Drip pacing doubles as a watermark: the next tick only
+       * emits if a ring buffer has drained, so a stalled client
+       * accumulates at most one ring of data, never an unbounded
+       * backlog. A client stalled hard enough to return NGX_AGAIN
+       * falls through to the send_timeout arm below instead.
+       */
+      wev->delayed = 1;
+      ngx_add_timer(wev, dali_ctx->interval);
+      break;
+    }
+
+    if (rc == NGX_AGAIN) {
+      ngx_add_timer(wev, clcf->send_timeout);
+      break;
+    }
+
+    /*
+     * Nothing could be refilled yet nothing was refused: some
+     * downstream filter is holding the ring (a postponed
+     * subrequest, say). Poll briefly rather than spin; its
+     * progress does not reliably raise our write event.
+     */
+    if (out == NULL) {
+      wev->delayed = 1;
+      ngx_add_timer(wev, 50);
+      break;
+    }
+
+    /*
+     * Everything sent and more to go: fair-share the worker by
+     * re-posting the write event once this invocation has pushed
+     * its budget, instead of monopolizing the event loop for the
+     * whole body.
+     */
+    if ((size_t)(dali_ctx->offset - start_offset) >=
+        NGX_HTTP_DALI_STREAM_YIELD) {
+      ngx_post_event(wev, &ngx_posted_events);
+      break;
+    }
+  }
+
+  if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+  }
+}
+
+/*
+ * ngx_http_dali_stream_start
+ *
+ * Push the first batch of ring buffers and, if the response did
+ * not complete synchronously, hand the rest of the work to the
+ * write-event handler. An extra reference is taken on the
+ * request so that the NGX_DONE we return does not tear it down
+ * while buffers are still circulating.
+ *
+ * Input: Information about the request being satisfied.
+ *        The Dali context for that request.
+ * Output: A status code suitable for finalizing the request.
+ */
+static ngx_int_t ngx_http_dali_stream_start(ngx_http_request_t *r,
+                                            ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_int_t rc;
+
+  if (dali_ctx->rate > 0) {
+    /*
+     * Prime the bucket with one wakeup's worth of tokens so the
+     * first bytes leave immediately; everything after that is
+     * timer-driven through the writer.
+     */
+    dali_ctx->last_fill = ngx_current_msec;
+    dali_ctx->tokens = dali_ctx->rate / 10 + 1;
+  } else if (dali_ctx->interval > 0) {
+    /*
+     * Slow drip: the writer below emits the first chunk right
+     * away and arms the interval timer for the rest.
+     */
+  } else {
+    rc = ngx_http_output_filter(r, ngx_http_dali_stream_fill(dali_ctx));
+    if (rc == NGX_ERROR) {
+      return rc;
+    }
+
+    if (dali_ctx->remaining == 0 && !dali_ctx->unbounded && rc == NGX_OK) {
+      ngx_http_dali_stream_uncharge(dali_ctx);
+      return rc;
+    }
+  }
+
+  r->main->count++;
+  r->write_event_handler = ngx_http_dali_stream_writer;
+  ngx_http_dali_stream_writer(r);
+
+  return NGX_DONE;
+}
+
+static ngx_int_t ngx_http_dali_send_response(ngx_http_request_t *r);
+
+/*
+ * ngx_http_dali_delay_expired
+ *
+ * The timer handler that fires once a request's artificial
+ * first-byte delay has elapsed; it resumes the response exactly
+ * where it was put to sleep.
+ *
+ * Input: The expired delay event (its data is the request).
+ * Output: None.
+ */
+static void ngx_http_dali_delay_expired(ngx_event_t *ev) {
+  ngx_http_request_t *r = ev->data;
+
+  ngx_http_finalize_request(r, ngx_http_dali_send_response(r));
+}
+
+/*
+ * ngx_http_dali_delay_cleanup
+ *
+ * Pool-cleanup callback that removes a still-pending delay timer
+ * when a request is torn down early (client abort, worker
+ * shutdown), so the timer cannot fire into freed memory.
+ *
+ * Input: The delay event registered for the request.
+ * Output: None.
+ */
+static void ngx_http_dali_delay_cleanup(void *data) {
+  ngx_event_t *ev = data;
+
+  if (ev->timer_set) {
+    ngx_del_timer(ev);
+  }
+}
+
+/*
+ * ngx_http_dali_build_echo_chain
+ *
+ * Echo mode: wire the buffers that
+ * ngx_http_read_client_request_body collected straight into the
+ * output chain -- no copy, whether the body sits in memory or
+ * spilled to a client-body temp file. The response length is the
+ * sum of what actually arrived, which also covers chunked
+ * uploads where no Content-Length was given.
+ *
+ * Input: Information about the request being satisfied.
+ *        The Dali context for that request.
+ * Output: NGX_OK if the chain could be built; NGX_ERROR otherwise.
+ */
+static ngx_int_t ngx_http_dali_build_echo_chain(ngx_http_request_t *r,
+                                                ngx_http_dali_ctx_t *dali_ctx) {
+  size_t total = 0;
+  ngx_chain_t *link;
+  ngx_buf_t *last = NULL;
+
+  if (r->request_body && r->request_body->bufs) {
+    dali_ctx->output_chain = r->request_body->bufs;
+
+    for (link = dali_ctx->output_chain; link; link = link->next) {
+      total += ngx_buf_size(link->buf);
+      last = link->buf;
+    }
+
+    last->last_buf = 1;
+    last->last_in_chain = 1;
+    dali_ctx->buffer = dali_ctx->output_chain->buf;
+  } else {
+    /* An empty upload still needs the special last_buf buffer. */
+    ngx_memzero(&dali_ctx->buf, sizeof(ngx_buf_t));
+    dali_ctx->buf.last_buf = 1;
+    dali_ctx->buf.last_in_chain = 1;
+    dali_ctx->chain.buf = &dali_ctx->buf;
+    dali_ctx->chain.next = NULL;
+    dali_ctx->buffer = &dali_ctx->buf;
+    dali_ctx->output_chain = &dali_ctx->chain;
+  }
+
+  dali_ctx->length = total;
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_build_header_blob
+ *
+ * Serialize the response headers for this location once, leaving
+ * a hole where the Date value goes so it can be patched in place
+ * on every request. Usually called at configuration-merge time
+ * (from the cycle pool via cf->pool); the request-time call is
+ * only a fallback. The blob lives as long as the cycle.
+ *
+ * Input: The configuration for the matched location.
+ *        The pool the blob should live in.
+ *        Which Connection variant to build (1 for keep-alive).
+ * Output: NGX_OK if the blob was built.
+ */
+static ngx_int_t ngx_http_dali_build_header_blob(ngx_http_dali_conf_t *conf,
+                                                 ngx_pool_t *pool,
+                                                 ngx_uint_t keepalive) {
+  u_char *p;
+  size_t size;
+  static const char head[] =
+      "HTTP/1.1 200 OK\r\nServer: " NGINX_VER "\r\nDate: ";
+  static const char mid[] =
+      "\r\nContent-Type: application/octet-stream\r\nContent-Length: ";
+  static const char tail_keepalive[] = "\r\nConnection: keep-alive\r\n\r\n";
+  static const char tail_close[] = "\r\nConnection: close\r\n\r\n";
+
+  size = sizeof(head) - 1 + ngx_cached_http_time.len + sizeof(mid) - 1 +
+         NGX_SIZE_T_LEN + sizeof(tail_keepalive) - 1;
+
+  p = ngx_palloc(pool, size);
+  if (!p) {
+    return NGX_ERROR;
+  }
+  conf->header_blob[keepalive].data = p;
+
+  p = ngx_cpymem(p, head, sizeof(head) - 1);
+  conf->header_date_offset[keepalive] =
+      p - conf->header_blob[keepalive].data;
+  p = ngx_cpymem(p, ngx_cached_http_time.data, ngx_cached_http_time.len);
+  p = ngx_cpymem(p, mid, sizeof(mid) - 1);
+  p = ngx_sprintf(p, "%uz", conf->length);
+  if (keepalive) {
+    p = ngx_cpymem(p, tail_keepalive, sizeof(tail_keepalive) - 1);
+  } else {
+    p = ngx_cpymem(p, tail_close, sizeof(tail_close) - 1);
+  }
+
+  conf->header_blob[keepalive].len =
+      p - conf->header_blob[keepalive].data;
+
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_send_cached_response
+ *
+ * Replay the location's precomputed header bytes and splice the
+ * body chain behind them in a single output-filter call, instead
+ * of rebuilding identical headers and running the header filter
+ * chain on every request.
+ *
+ * Input: Information about the request being satisfied.
+ *        The configuration for the matched location.
+ *        The Dali context for that request.
+ * Output: A status code suitable for finalizing the request.
+ */
+static ngx_int_t ngx_http_dali_send_cached_response(ngx_http_request_t *r,
+                                                    ngx_http_dali_conf_t *conf,
+                                                    ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_uint_t keepalive;
+  ngx_str_t *blob;
+  ngx_buf_t *header_buf;
+  ngx_chain_t *link;
+
+  keepalive = r->keepalive ? 1 : 0;
+
+  if (!conf->header_blob[keepalive].data) {
+    if (ngx_http_dali_build_header_blob(conf, ngx_cycle->pool, keepalive) !=
+        NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
+  blob = &conf->header_blob[keepalive];
+
+  /*
+   * Refresh the Date in place. The event loop is single
+   * threaded, so no in-flight writev can observe a torn value.
+   */
+  ngx_memcpy(blob->data + conf->header_date_offset[keepalive],
+             ngx_cached_http_time.data, ngx_cached_http_time.len);
+
+  header_buf = ngx_calloc_buf(r->pool);
+  link = ngx_alloc_chain_link(r->pool);
+  if (!header_buf || !link) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  header_buf->pos = blob->data;
+  header_buf->last = blob->data + blob->len;
+  header_buf->start = header_buf->pos;
+  header_buf->end = header_buf->last;
+  header_buf->memory = 1;
+
+  link->buf = header_buf;
+  link->next = dali_ctx->output_chain;
+
+  /*
+   * Keep the bookkeeping that the log and core modules read
+   * truthful, and mark the header as sent so no filter tries to
+   * emit a second one.
+   */
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = dali_ctx->length;
+  r->header_sent = 1;
+
+  dali_ctx->t_sent = ngx_http_dali_monotonic_us();
+  ngx_http_dali_probe2(header_send, r, dali_ctx->length);
+  ngx_http_dali_account(dali_ctx->length);
+
+  return ngx_http_output_filter(r, link);
+}
+
+#if (NGX_HTTP_GZIP)
+/*
+ * ngx_http_dali_send_precompressed
+ *
+ * Serve a gzip blob that a worker built once at startup instead
+ * of letting the gzip filter deflate the same zeros on every
+ * request. Only fixed configured lengths have blobs; anything
+ * else (per-request lengths, ranges, clients that did not ask
+ * for gzip) falls through to the ordinary path.
+ *
+ * Input: Information about the request being satisfied.
+ *        The Dali context for that request.
+ * Output: NGX_DECLINED when the request cannot use a blob,
+ * otherwise a status code suitable for finalizing the request.
+ */
+static ngx_int_t ngx_http_dali_send_precompressed(ngx_http_request_t *r,
+                                                  ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_uint_t i;
+  ngx_str_t *blob = NULL;
+  ngx_table_elt_t *h;
+  ngx_buf_t *body_buf;
+  ngx_chain_t out;
+  ngx_int_t ngx_send_header_rc;
+
+  for (i = 0; i < ngx_http_dali_encoded_n; i++) {
+    if (ngx_http_dali_encoded[i].length == dali_ctx->length &&
+        ngx_http_dali_encoded[i].gzip.data) {
+      blob = &ngx_http_dali_encoded[i].gzip;
+      break;
+    }
+  }
+  if (!blob) {
+    return NGX_DECLINED;
+  }
+
+  if (ngx_http_gzip_ok(r) != NGX_OK) {
+    return NGX_DECLINED;
+  }
+
+  h = ngx_list_push(&r->headers_out.headers);
+  if (!h) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  h->hash = 1;
+  ngx_str_set(&h->key, "Content-Encoding");
+  ngx_str_set(&h->value, "gzip");
+  /*
+   * Announcing an encoding of our own also tells the gzip filter
+   * the body is already compressed, so it will not touch it.
+   */
+  r->headers_out.content_encoding = h;
+
+  ngx_str_set(&r->headers_out.content_type, "application/octet-stream");
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = blob->len;
+  r->connection->sendfile = 0;
+
+  ngx_send_header_rc = ngx_http_send_header(r);
+  if (ngx_send_header_rc == NGX_ERROR) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if (ngx_send_header_rc > NGX_OK || r->header_only) {
+    return ngx_send_header_rc;
+  }
+
+  body_buf = ngx_calloc_buf(r->pool);
+  if (!body_buf) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  body_buf->pos = blob->data;
+  body_buf->last = blob->data + blob->len;
+  body_buf->start = body_buf->pos;
+  body_buf->end = body_buf->last;
+  body_buf->memory = 1;
+  body_buf->last_buf = (r == r->main) ? 1 : 0;
+  body_buf->last_in_chain = 1;
+
+  out.buf = body_buf;
+  out.next = NULL;
+
+  dali_ctx->t_sent = ngx_http_dali_monotonic_us();
+  ngx_http_dali_probe2(header_send, r, dali_ctx->length);
+
+  /* Account the logical (uncompressed) length, as elsewhere. */
+  ngx_http_dali_account(dali_ctx->length);
+
+  return ngx_http_output_filter(r, &out);
+}
+#endif
+
+/*
+ * ngx_http_dali_send_response
+ *
+ * Send the headers and body for a request whose context (and
+ * output chain) were prepared by ngx_http_dali_handler. This is
+ * shared between the body-buffering path (where it runs from the
+ * body-fetched callback) and the body-discarding path (where the
+ * handler calls it directly).
+ *
+ * Input: Information about the request being satisfied.
+ * Output: A status code suitable for finalizing the request.
+ */
+static ngx_int_t ngx_http_dali_send_response(ngx_http_request_t *r) {
+  ngx_int_t ngx_send_header_rc = NGX_OK;
+  ngx_http_dali_ctx_t *dali_ctx = NULL;
+  ngx_http_dali_conf_t *conf = NULL;
+
+  dali_ctx = ngx_http_get_module_ctx(r, ngx_http_dali_module);
+  if (!dali_ctx) {
+    ngx_log_error(
+        NGX_LOG_CRIT, r->connection->log, 0,
+        "Dali could not retrieve the Dali context");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /*
+   * Emulated origin latency: park the whole response on one
+   * timer insertion before the header goes out. The reference
+   * taken here keeps the request alive until the timer handler
+   * finalizes it. While parked, watch the client: a stall fault
+   * waits a full hour, and a client that gives up after its own
+   * few-second timeout must release the connection then, not
+   * when our timer finally fires. ngx_http_test_reading tears
+   * the request down as soon as the peer closes.
+   */
+  if (dali_ctx->delay > 0 && !dali_ctx->delay_done) {
+    ngx_pool_cleanup_t *cln;
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (!cln) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    cln->handler = ngx_http_dali_delay_cleanup;
+    cln->data = &dali_ctx->delay_event;
+
+    dali_ctx->delay_done = 1;
+    dali_ctx->delay_event.handler = ngx_http_dali_delay_expired;
+    dali_ctx->delay_event.data = r;
+    dali_ctx->delay_event.log = r->connection->log;
+
+    if (!r->discard_body) {
+      r->read_event_handler = ngx_http_test_reading;
+    }
+
+    ngx_add_timer(&dali_ctx->delay_event, dali_ctx->delay);
+    r->main->count++;
+    return NGX_DONE;
+  }
+
+  /*
+   * Echo responses can only be assembled now, after the client
+   * body has been read.
+   */
+  if (dali_ctx->mode == NGX_HTTP_DALI_MODE_ECHO) {
+    if (ngx_http_dali_build_echo_chain(r, dali_ctx) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
+
+  /*
+   * Cached-header fast path: an HTTP/1.x response for a fixed
+   * configured length, going out in one shot, is byte-identical
+   * to the last one except for the Date -- replay it. Requests
+   * that vary (h2/h3, per-request lengths, streamed bodies) take
+   * the regular header filter below. Splicing the header bytes
+   * in front of the body also submits the whole response as one
+   * chain -- one writev, and one TCP segment for sub-MSS bodies
+   * -- where the two-step path below costs a second filter pass
+   * and often a second syscall. The replay skips every header
+   * filter (add_header, gzip, and friends never see the
+   * response), which is why it stays strictly opt-in behind
+   * `dali_cached_headers`.
+   */
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_dali_module);
+  if (conf && conf->cached_headers &&
+      conf->dist == NGX_HTTP_DALI_DIST_NONE && !conf->length_cv &&
+      dali_ctx->ring_size == 0 && r == r->main && !r->header_only &&
+      dali_ctx->mode != NGX_HTTP_DALI_MODE_ECHO &&
+      r->headers_in.range == NULL &&
+      r->http_version >= NGX_HTTP_VERSION_10 &&
+      r->http_version < NGX_HTTP_VERSION_20) {
+    if (dali_ctx->mode != NGX_HTTP_DALI_MODE_SENDFILE) {
+      r->connection->sendfile = 0;
+    }
+    return ngx_http_dali_send_cached_response(r, conf, dali_ctx);
+  }
+
+#if (NGX_HTTP_GZIP)
+  /*
+   * Precompressed fast path: gzip-accepting clients asking for a
+   * fixed-length, one-shot response can be answered from the
+   * startup-built blob without running the deflate code at all.
+   */
+  if (conf && conf->precompress && dali_ctx->ring_size == 0 &&
+      dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_ZERO &&
+      dali_ctx->mode != NGX_HTTP_DALI_MODE_ECHO &&
+      r->headers_in.range == NULL) {
+    ngx_send_header_rc = ngx_http_dali_send_precompressed(r, dali_ctx);
+    if (ngx_send_header_rc != NGX_DECLINED) {
+      return ngx_send_header_rc;
+    }
+  }
+#endif
+
+  ngx_str_set(&r->headers_out.content_type, "application/octet-stream");
+
+  ngx_http_dali_log_debug(r->connection->log,
+                          "Dali module responding with a %uz byte response",
+                          dali_ctx->length);
+
+  r->headers_out.content_length_n =
+      dali_ctx->unbounded ? -1 : (off_t)dali_ctx->length;
+  r->headers_out.status = NGX_HTTP_OK;
+
+  /*
+   * Synthetic content is trivially seekable, so honor Range
+   * requests on one-shot responses: flagging the response as
+   * range-capable lets nginx's range filter turn a request for
+   * bytes m-n into plain file_pos/file_last arithmetic on our
+   * buffer and emit the 206 and Content-Range header. Streamed
+   * responses build their chain incrementally, which the range
+   * filter cannot slice, so they stay full-body.
+   */
+  if (dali_ctx->ring_size == 0) {
+    r->allow_ranges = 1;
+  }
+
+  /*
+   * In sendfile mode we leave the connection's sendfile setting
+   * alone so the kernel can move the (sparse) backing file with
+   * zero user-space copies. The other modes must disable it
+   * because their buffers are not sendfile-able.
+   */
+  if (dali_ctx->mode != NGX_HTTP_DALI_MODE_SENDFILE) {
+    r->connection->sendfile = 0;
+  }
+
+  ngx_send_header_rc = ngx_http_send_header(r);
+  if (ngx_send_header_rc == NGX_ERROR) {
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                  "Dali could not send the response header");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /*
+   * A special response from the header filters (or a request
+   * that only wants headers) is complete at this point; pass the
+   * status through rather than mislabeling it an error.
+   */
+  if (ngx_send_header_rc > NGX_OK || r->header_only) {
+    return ngx_send_header_rc;
+  }
+
+  dali_ctx->t_sent = ngx_http_dali_monotonic_us();
+  ngx_http_dali_probe2(header_send, r, dali_ctx->length);
+  ngx_http_dali_account(dali_ctx->length);
+
+  /*
+   * Responses big enough to use the buffer ring are streamed;
+   * everything else goes out in one shot.
+   */
+  if (dali_ctx->ring_size > 0) {
+    return ngx_http_dali_stream_start(r, dali_ctx);
+  }
+
+  /*
+   * Kick off the nginx processing chain that will ultimately
+   * send our response body back to the user.
+   */
+  ngx_send_header_rc = ngx_http_output_filter(r, dali_ctx->output_chain);
+  ngx_http_dali_probe2(finalize, r, ngx_send_header_rc);
+  return ngx_send_header_rc;
+}
+
+static void ngx_http_dali_client_body_fetched_handler(ngx_http_request_t *r) {
+  ngx_http_dali_ctx_t *dali_ctx;
+
+  dali_ctx = ngx_http_get_module_ctx(r, ngx_http_dali_module);
+  if (dali_ctx) {
+    dali_ctx->t_body = ngx_http_dali_monotonic_us();
+  }
+
+  ngx_http_dali_probe1(body_read, r);
+  ngx_http_finalize_request(r, ngx_http_dali_send_response(r));
+}
+
+/*
+ * ngx_http_dali_status_handler
+ *
+ * Render the shared counters as a small text document, in the
+ * spirit of stub_status: total requests, total bytes, and the
+ * non-empty buckets of the length histogram.
+ *
+ * Input: Information about the request being satisfied.
+ * Output: An error code indicating to nginx whether we were
+ * successful in generating the status page.
+ */
+static ngx_int_t ngx_http_dali_status_handler(ngx_http_request_t *r) {
+  ngx_int_t rc;
+  ngx_buf_t *b;
+  ngx_chain_t out;
+  ngx_uint_t i;
+  size_t size;
+  ngx_http_dali_stats_t *stats;
+
+  if (!(r->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  if (!ngx_http_dali_stats_zone || !ngx_http_dali_stats_zone->data) {
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                  "Dali has no statistics zone to report from");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  stats = ngx_http_dali_stats_zone->data;
+
+  /*
+   * Two summary lines plus (at most) one line per histogram
+   * bucket, each a short label and one counter.
+   */
+  size = (2 + NGX_HTTP_DALI_HISTOGRAM_BUCKETS) *
+         (sizeof("dali_length_le_: \n") - 1 + 2 * NGX_ATOMIC_T_LEN);
+
+  b = ngx_create_temp_buf(r->pool, size);
+  if (!b) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  b->last = ngx_sprintf(b->last, "dali_requests: %uA\n", stats->requests);
+  b->last = ngx_sprintf(b->last, "dali_bytes: %uA\n", stats->bytes);
+  for (i = 0; i < NGX_HTTP_DALI_HISTOGRAM_BUCKETS; i++) {
+    if (stats->histogram[i] == 0) {
+      continue;
+    }
+    b->last = ngx_sprintf(b->last, "dali_length_le_%uz: %uA\n",
+                          (size_t)1 << i, stats->histogram[i]);
+  }
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  b->last_buf = 1;
+  b->last_in_chain = 1;
+  out.buf = b;
+  out.next = NULL;
+
+  return ngx_http_output_filter(r, &out);
+}
+
+/* Which timing variable a getter invocation is asked for. */
+#define NGX_HTTP_DALI_VAR_BYTES      0
+#define NGX_HTTP_DALI_VAR_GENERATION 1
+#define NGX_HTTP_DALI_VAR_QUEUE      2
+
+/*
+ * ngx_http_dali_timing_variable
+ *
+ * The get handler behind $dali_bytes_sent, $dali_generation_us,
+ * and $dali_queue_us. Bytes come straight from the request
+ * context; the timing values are differences of the monotonic
+ * timestamps captured on the request path: queue is how long the
+ * request waited for its client body, generation is from there
+ * (or from handler entry, when no body was read) to the header
+ * going out.
+ *
+ * Input: Information about the request being satisfied.
+ *        The variable value to fill in.
+ *        Which of the three variables is wanted.
+ * Output: NGX_OK; the value is marked not_found on requests that
+ * never reached the Dali handler.
+ */
+static ngx_int_t ngx_http_dali_timing_variable(ngx_http_request_t *r,
+                                               ngx_http_variable_value_t *v,
+                                               uintptr_t data) {
+  ngx_http_dali_ctx_t *dali_ctx;
+  uint64_t value, from;
+  u_char *p;
+
+  dali_ctx = ngx_http_get_module_ctx(r, ngx_http_dali_module);
+  if (!dali_ctx) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  switch (data) {
+  case NGX_HTTP_DALI_VAR_BYTES:
+    /* Streamed responses count what the ring has emitted so far. */
+    value = dali_ctx->ring_size > 0 ? (uint64_t)dali_ctx->offset
+                                    : (uint64_t)dali_ctx->length;
+    break;
+
+  case NGX_HTTP_DALI_VAR_GENERATION:
+    from = dali_ctx->t_body ? dali_ctx->t_body : dali_ctx->t_start;
+    value = dali_ctx->t_sent > from ? dali_ctx->t_sent - from : 0;
+    break;
+
+  default: /* NGX_HTTP_DALI_VAR_QUEUE */
+    value = dali_ctx->t_body > dali_ctx->t_start
+                ? dali_ctx->t_body - dali_ctx->t_start
+                : 0;
+    break;
+  }
+
+  p = ngx_pnalloc(r->pool, NGX_INT64_LEN);
+  if (!p) {
+    return NGX_ERROR;
+  }
+
+  v->len = ngx_sprintf(p, "%uL", value) - p;
+  v->data = p;
+  v->valid = 1;
+  v->no_cacheable = 1;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+static ngx_http_variable_t ngx_http_dali_variables[] = {
+    {ngx_string("dali_bytes_sent"), NULL, ngx_http_dali_timing_variable,
+     NGX_HTTP_DALI_VAR_BYTES, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    {ngx_string("dali_generation_us"), NULL, ngx_http_dali_timing_variable,
+     NGX_HTTP_DALI_VAR_GENERATION, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    {ngx_string("dali_queue_us"), NULL, ngx_http_dali_timing_variable,
+     NGX_HTTP_DALI_VAR_QUEUE, NGX_HTTP_VAR_NOCACHEABLE, 0},
+    ngx_http_null_variable};
+
+/*
+ * ngx_http_dali_add_variables
+ *
+ * Register the module's variables (from the preconfiguration
+ * hook) so log_format (and anything else that evaluates
+ * variables) can use them.
+ *
+ * Input: The overall server configuration.
+ * Output: NGX_OK if every variable could be registered.
+ */
+static ngx_int_t ngx_http_dali_add_variables(ngx_conf_t *cf) {
+  ngx_http_variable_t *var, *v;
+
+  for (v = ngx_http_dali_variables; v->name.len; v++) {
+    var = ngx_http_add_variable(cf, &v->name, v->flags);
+    if (var == NULL) {
+      return NGX_ERROR;
+    }
+
+    var->get_handler = v->get_handler;
+    var->data = v->data;
+  }
+
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_preconfiguration
+ *
+ * The preconfiguration hook. Besides registering the module's
+ * variables, it resets every process-level static that the
+ * directive handlers and merge accumulate into, so a reload
+ * starts from a clean slate: the sendfile sizing only reflects
+ * lengths the new configuration actually mentions, the
+ * precompression registry stops re-gzipping (and filling its
+ * fixed table with) lengths from locations that no longer exist,
+ * and the random arena is only mapped while some location still
+ * asks for random payloads. (Parse results belong to the cycle;
+ * these statics merely mirror them for the worker hooks, so they
+ * must be re-derived on every parse.)
+ *
+ * Input: The overall server configuration.
+ * Output: NGX_OK if every variable could be registered.
+ */
+static ngx_int_t ngx_http_dali_preconfiguration(ngx_conf_t *cf) {
+  ngx_http_dali_max_length = 0;
+  ngx_str_set(&ngx_http_dali_sendfile_dir, "/tmp");
+  ngx_http_dali_random_arena_wanted = 0;
+
+#if (NGX_HTTP_GZIP)
+  ngx_memzero(ngx_http_dali_encoded, sizeof(ngx_http_dali_encoded));
+  ngx_http_dali_encoded_n = 0;
+#endif
+
+  return ngx_http_dali_add_variables(cf);
+}
+
+/*
+ * ngx_http_dali_build_file_chain
+ *
+ * Build the single-buffer output chain that serves the response
+ * body from the worker's /dev/zero descriptor. nginx will read
+ * the configured number of bytes out of the file and copy them
+ * to the client.
+ *
+ * Input: Information about the request being satisfied.
+ *        The Dali context for that request.
+ * Output: NGX_OK if the chain could be built; NGX_ERROR otherwise.
+ */
+static ngx_int_t ngx_http_dali_build_file_chain(ngx_http_request_t *r,
+                                                ngx_http_dali_conf_t *conf,
+                                                ngx_http_dali_ctx_t *dali_ctx) {
+  ngx_fd_t   fd;
+  ngx_str_t *name;
+
+  /*
+   * Both file-backed modes reuse a descriptor opened once for
+   * this worker in ngx_http_dali_init_process. The descriptors
+   * stay open until the worker exits, so there is no per-request
+   * open or cleanup to register.
+   */
+  if (dali_ctx->mode == NGX_HTTP_DALI_MODE_SENDFILE) {
+    fd = ngx_http_dali_sendfile_fd;
+    name = &ngx_http_dali_sendfile_path;
+  } else {
+    fd = ngx_http_dali_dev_zero_fd;
+    name = &ngx_http_dali_dev_zero_path;
+  }
+  if (fd == NGX_INVALID_FILE) {
+    return NGX_ERROR;
+  }
+
+  /*
+   * Stamp out the per-location buffer template (one structure
+   * copy) and then fill in the few fields that vary per request.
+   */
+  dali_ctx->buf = conf->buffer_template;
+  dali_ctx->buf.file_pos = 0;
+  dali_ctx->buf.file_last = dali_ctx->length;
+  dali_ctx->buf.file = &dali_ctx->file;
+
+  /*
+   * Nothing extra is needed here for `aio threads`: the copy
+   * filter sees an in_file buffer, installs its thread handler
+   * on this ngx_file_t, and services the read off the event
+   * loop. We only have to leave directio off and the file
+   * fields sane.
+   */
+  dali_ctx->file.fd = fd;
+  dali_ctx->file.name = *name;
+  dali_ctx->file.log = r->connection->log;
+  dali_ctx->file.directio = false;
+
+  dali_ctx->chain.buf = &dali_ctx->buf;
+  dali_ctx->chain.next = NULL;
+
+  dali_ctx->buffer = &dali_ctx->buf;
+  dali_ctx->output_chain = &dali_ctx->chain;
+
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_payload_slice
+ *
+ * Pick the arena window that the next in-memory buffer should
+ * cover. Zero payloads always start at the front of the zero
+ * arena; random payloads start at a PRNG-chosen offset into the
+ * random arena so back-to-back responses (and back-to-back
+ * buffers of one response) are not byte-identical.
+ *
+ * Input: The payload kind for the request.
+ *        How many bytes the caller still wants to emit.
+ *        A place to store the base of the chosen window.
+ * Output: How many bytes the window can provide.
+ */
+static size_t ngx_http_dali_payload_slice(ngx_uint_t payload, size_t want,
+                                          u_char **base) {
+  size_t offset;
+
+  if (payload == NGX_HTTP_DALI_PAYLOAD_RANDOM) {
+    offset = (size_t)(ngx_http_dali_prng_next() %
+                      (NGX_HTTP_DALI_ARENA_SIZE / 2));
+    *base = ngx_http_dali_random_arena + offset;
+    return ngx_min(want, NGX_HTTP_DALI_ARENA_SIZE - offset);
+  }
+
+  *base = ngx_http_dali_arena;
+  return ngx_min(want, NGX_HTTP_DALI_ARENA_SIZE);
+}
+
+/*
+ * ngx_http_dali_counter_fill
+ *
+ * Generate counter-payload bytes for an arbitrary byte range of
+ * the body: byte i is byte (i mod 8) of the little-endian
+ * splitmix64(seed + i/8) word. Each word is one multiply-and-
+ * shift mix and one 8-byte store, a loop the compiler can unroll
+ * and vectorize, so generation runs at memory-bandwidth speed
+ * with no backing file or arena at all.
+ *
+ * Input: The destination buffer and how many bytes to produce.
+ *        The configured seed.
+ *        The body offset the destination corresponds to.
+ * Output: None.
+ */
+static void ngx_http_dali_counter_fill(u_char *dst, size_t len, uint64_t seed,
+                                       off_t offset) {
+  uint64_t word_index = (uint64_t)offset >> 3;
+  size_t skip = (size_t)offset & 7;
+  uint64_t v;
+  u_char bytes[8];
+  size_t n, j;
+
+  while (len > 0) {
+    v = ngx_http_dali_splitmix(seed + word_index);
+    for (j = 0; j < 8; j++) {
+      bytes[j] = (u_char)(v >> (8 * j));
+    }
+
+    n = ngx_min(len, 8 - skip);
+    ngx_memcpy(dst, bytes + skip, n);
+    dst += n;
+    len -= n;
+    skip = 0;
+    word_index++;
+  }
+}
+
+/*
+ * ngx_http_dali_build_memory_chain
+ *
+ * Build an output chain that serves the response body straight
+ * out of the worker's pre-zeroed arena. Every buffer in the
+ * chain is a read-only window onto the same region, so a body of
+ * any length costs no read(2) and no per-request zeroing.
+ *
+ * Input: Information about the request being satisfied.
+ *        The Dali context for that request.
+ * Output: NGX_OK if the chain could be built; NGX_ERROR otherwise.
+ */
+static ngx_int_t ngx_http_dali_build_memory_chain(ngx_http_request_t *r,
+                                                  ngx_http_dali_conf_t *conf,
+                                                  ngx_http_dali_ctx_t *dali_ctx) {
+  size_t        remaining;
+  size_t        portion;
+  u_char       *base;
+  ngx_buf_t    *buffer;
+  ngx_chain_t  *link;
+  ngx_chain_t **rest;
+
+  /*
+   * A counter body is generated rather than sliced out of an
+   * arena: small enough to be here (larger ones stream), it is
+   * filled once into a single request-pool buffer.
+   */
+  if (dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_COUNTER) {
+    base = ngx_palloc(r->pool, dali_ctx->length);
+    if (!base) {
+      return NGX_ERROR;
+    }
+    ngx_http_dali_counter_fill(base, dali_ctx->length, dali_ctx->seed, 0);
+
+    buffer = &dali_ctx->buf;
+    *buffer = conf->buffer_template;
+    buffer->pos = base;
+    buffer->last = base + dali_ctx->length;
+    buffer->start = buffer->pos;
+    buffer->end = buffer->last;
+
+    dali_ctx->chain.buf = buffer;
+    dali_ctx->chain.next = NULL;
+    dali_ctx->output_chain = &dali_ctx->chain;
+    dali_ctx->buffer = buffer;
+
+    return NGX_OK;
+  }
+
+  if (dali_ctx->payload == NGX_HTTP_DALI_PAYLOAD_RANDOM
+          ? !ngx_http_dali_random_arena
+          : !ngx_http_dali_arena) {
+    return NGX_ERROR;
+  }
+
+  remaining = dali_ctx->length;
+  rest = &dali_ctx->output_chain;
+
+  /*
+   * The first buffer and chain link are embedded in the context;
+   * additional links are only allocated when the body is longer
+   * than the arena. Use a do/while so that even a zero-length
+   * response gets the special buffer that carries the last_buf
+   * flag.
+   */
+  do {
+    portion = ngx_http_dali_payload_slice(dali_ctx->payload, remaining, &base);
+
+    if (rest == &dali_ctx->output_chain) {
+      buffer = &dali_ctx->buf;
+      link = &dali_ctx->chain;
+    } else {
+      buffer = ngx_calloc_buf(r->pool);
+      link = ngx_alloc_chain_link(r->pool);
+      if (!buffer || !link) {
+        return NGX_ERROR;
+      }
+    }
+
+    *buffer = conf->buffer_template;
+    buffer->pos = base;
+    buffer->last = base + portion;
+    buffer->start = buffer->pos;
+    buffer->end = buffer->last;
+
+    remaining -= portion;
+    if (remaining > 0) {
+      buffer->last_buf = 0;
+      buffer->last_in_chain = 0;
+    }
+
+    link->buf = buffer;
+    link->next = NULL;
+    *rest = link;
+    rest = &link->next;
+  } while (remaining > 0);
+
+  /*
+   * Remember the head buffer so the rest of the module can keep
+   * treating dali_ctx->buffer as "the" response buffer.
+   */
+  dali_ctx->buffer = dali_ctx->output_chain->buf;
+
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_resolve_length
+ *
+ * Work out how long this response should be. For the common
+ * (literal) configuration this is a single load from the
+ * location configuration. When the `dali` directive was given
+ * variables, evaluate the compiled complex value and parse it as
+ * a plain byte count with ngx_atosz -- a tight digit loop, no
+ * allocation -- and clamp the result to the configured
+ * `dali_max_length` so a client cannot ask for the moon.
+ *
+ * Input: Information about the request being satisfied.
+ *        The configuration for the matched location.
+ *        A place to store the resolved length.
+ * Output: NGX_OK on success, or an HTTP status to finalize the
+ * request with when the client-supplied value is unusable.
+ */
+static ngx_int_t ngx_http_dali_resolve_length(ngx_http_request_t *r,
+                                              ngx_http_dali_conf_t *conf,
+                                              size_t *length) {
+  ngx_str_t value;
+  ssize_t parsed;
+
+  /*
+   * Distribution sampling: one PRNG call plus either a modulus
+   * (uniform) or a table load (the precomputed quantiles of the
+   * heavy-tailed distributions).
+   */
+  if (conf->dist != NGX_HTTP_DALI_DIST_NONE) {
+    if (conf->dist == NGX_HTTP_DALI_DIST_UNIFORM) {
+      *length = conf->dist_min +
+                (size_t)(ngx_http_dali_prng_next() %
+                         (conf->dist_max - conf->dist_min + 1));
+    } else {
+      *length = conf->dist_table[ngx_http_dali_prng_next() &
+                                 (NGX_HTTP_DALI_DIST_TABLE_SIZE - 1)];
+    }
+    return NGX_OK;
+  }
+
+  if (!conf->length_cv) {
+    *length = conf->length;
+    return NGX_OK;
+  }
+
+  if (ngx_http_complex_value(r, conf->length_cv, &value) != NGX_OK) {
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                  "Dali could not evaluate the response length");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  parsed = ngx_atosz(value.data, value.len);
+  if (parsed == NGX_ERROR) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "Dali received an unparseable length \"%V\"", &value);
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  if (conf->max_length > 0 && (size_t)parsed > conf->max_length) {
+    parsed = conf->max_length;
+  }
+
+  *length = parsed;
+  return NGX_OK;
+}
+
+/*
+ * ngx_http_dali_conn_ctx_cleanup
+ *
+ * Pool cleanup for the connection-cached context. The memory
+ * itself belongs to the connection pool, so there is nothing to
+ * release; the handler's address is what matters -- it is the
+ * tag ngx_http_dali_conn_ctx scans for. It also settles any
+ * outstanding adaptive-buffer charge, for connections that close
+ * while a stream is still in flight.
+ *
+ * Input: The cached context.
+ * Output: None.
+ */
+static void ngx_http_dali_conn_ctx_cleanup(void *data) {
+  ngx_http_dali_stream_uncharge(data);
+}
+
+/*
+ * ngx_http_dali_conn_ctx
+ *
+ * Find the Dali context cached on a connection, if any, by
+ * walking the connection pool's cleanup list for our marker
+ * handler. The list is a few entries long at most.
+ *
+ * Input: The connection to search.
+ * Output: The cached context, or NULL when this connection has
+ * not carried a Dali request before.
+ */
+static ngx_http_dali_ctx_t *ngx_http_dali_conn_ctx(ngx_connection_t *c) {
+  ngx_pool_cleanup_t *cln;
+
+  for (cln = c->pool->cleanup; cln; cln = cln->next) {
+    if (cln->handler == ngx_http_dali_conn_ctx_cleanup) {
+      return cln->data;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * ngx_http_dali_acquire_ctx
+ *
+ * Get the context for a request. Keepalive clients send many
+ * requests down one connection, and allocating a fresh context
+ * (and re-registering its cleanup) for each one was the largest
+ * steady-state cost on a hot connection. Main requests therefore
+ * keep their context in the connection pool and recycle it: the
+ * second and later requests on a connection pay one memzero and
+ * no allocation. The buffer ring survives the reset so streamed
+ * responses reuse it too (see ngx_http_dali_stream_init).
+ * Subrequests share their connection with the main request, so
+ * they still get a private, request-pool context.
+ *
+ * Input: Information about the request being satisfied.
+ * Output: A zeroed context ready to populate, or NULL.
+ */
+static ngx_http_dali_ctx_t *ngx_http_dali_acquire_ctx(ngx_http_request_t *r) {
+  ngx_connection_t *c = r->connection;
+  ngx_http_dali_ctx_t *dali_ctx;
+  ngx_pool_cleanup_t *cln;
+  ngx_buf_t *ring_bufs;
+  ngx_chain_t *ring_links;
+  ngx_uint_t ring_capacity;
+  u_char *ring_data;
+  size_t ring_data_size;
+  size_t adapt_size;
+
+  if (r != r->main) {
+    return ngx_pcalloc(r->pool, sizeof(ngx_http_dali_ctx_t));
+  }
+
+  dali_ctx = ngx_http_dali_conn_ctx(c);
+  if (dali_ctx) {
+    /*
+     * A previous request that ended abnormally (client gone
+     * mid-stream) never reached the writer's uncharge; settle its
+     * account before the reset wipes the record.
+     */
+    ngx_http_dali_stream_uncharge(dali_ctx);
+
+    ring_bufs = dali_ctx->ring_bufs;
+    ring_links = dali_ctx->ring_links;
+    ring_capacity = dali_ctx->ring_capacity;
+    ring_data = dali_ctx->ring_data;
+    ring_data_size = dali_ctx->ring_data_size;
+    adapt_size = dali_ctx->adapt_size;
+
+    ngx_memzero(dali_ctx, sizeof(ngx_http_dali_ctx_t));
+
+    dali_ctx->ring_bufs = ring_bufs;
+    dali_ctx->ring_links = ring_links;
+    dali_ctx->ring_capacity = ring_capacity;
+    dali_ctx->ring_data = ring_data;
+    dali_ctx->ring_data_size = ring_data_size;
+    dali_ctx->adapt_size = adapt_size;
+    dali_ctx->conn_cached = 1;
+    return dali_ctx;
+  }
+
+  dali_ctx = ngx_pcalloc(c->pool, sizeof(ngx_http_dali_ctx_t));
+  if (!dali_ctx) {
+    return NULL;
+  }
+
+  cln = ngx_pool_cleanup_add(c->pool, 0);
+  if (!cln) {
+    return NULL;
   }
+  cln->handler = ngx_http_dali_conn_ctx_cleanup;
+  cln->data = dali_ctx;
 
-  /*
-   * Kick off the nginx processing chain that will ultimately
-   * send our response body back to the user.
-   */
-  ngx_http_finalize_request(r, ngx_http_output_filter(r, dali_ctx->output_chain));
+  dali_ctx->conn_cached = 1;
+  return dali_ctx;
 }
 
 /*
@@ -183,20 +2934,12 @@ static void ngx_http_dali_client_body_fetched_handler(ngx_http_request_t *r) {
 static ngx_int_t ngx_http_dali_handler(ngx_http_request_t *r) {
   ngx_http_dali_conf_t *conf = NULL;
   ngx_http_dali_ctx_t *dali_ctx = NULL;
-  ngx_pool_cleanup_t  *cln;
   ngx_int_t ngx_rc = NGX_OK;
+  ngx_uint_t unbounded = 0;
+  ngx_uint_t fault = NGX_HTTP_DALI_FAULT_NONE;
+  size_t length = 0;
 
-  dali_ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_dali_ctx_t));
-  if (!dali_ctx) {
-    ngx_log_error(
-        NGX_LOG_CRIT, r->connection->log, 0,
-        "Dali could not allocate a Dali context");
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-  }
-
-  /*
-   * ngx_pcalloc sets all to 0/NULL.
-   */
+  ngx_http_dali_probe1(handler_enter, r);
 
   /*
    * We could fail to read the module configuration.
@@ -208,62 +2951,144 @@ static ngx_int_t ngx_http_dali_handler(ngx_http_request_t *r) {
         "Dali could not access configuration data when handling a request");
     return NGX_HTTP_INTERNAL_SERVER_ERROR;
   }
-  dali_ctx->length = conf->length;
 
   /*
-   * We could fail to allocate space required for the meta structures.
+   * Fault injection: one masked load from the precompiled
+   * schedule. Errors are answered right here; stall and abort
+   * are noted and applied once the context exists.
    */
-  dali_ctx->output_chain = ngx_pcalloc(r->pool, sizeof(ngx_chain_t));
-  dali_ctx->buffer = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-  dali_ctx->buffer->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-
-  if (!dali_ctx->output_chain || !dali_ctx->buffer || !dali_ctx->buffer->file) {
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                  "Dali could not allocate memory for meta structures");
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  if (conf->fault_table) {
+    fault = conf->fault_table[ngx_http_dali_fault_seq++ &
+                              (NGX_HTTP_DALI_FAULT_TABLE_SIZE - 1)];
+    if (fault == NGX_HTTP_DALI_FAULT_ERROR) {
+      return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
   }
 
-  ngx_str_set(&dali_ctx->dev_zero_path, "/dev/zero");
-  dali_ctx->dev_zero_fd =
-      ngx_open_file(dali_ctx->dev_zero_path.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
-  if (dali_ctx->dev_zero_fd == NGX_INVALID_FILE) {
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                  "Dali could not open /dev/zero");
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  /*
+   * An unbounded location (`dali unbounded`) streams until the
+   * client disconnects, so there is nothing to resolve.
+   */
+  if (conf->unbounded) {
+    unbounded = 1;
+  } else {
+    ngx_rc = ngx_http_dali_resolve_length(r, conf, &length);
+    if (ngx_rc != NGX_OK) {
+      return ngx_rc;
+    }
   }
 
   /*
-   * Install a handler that will run when the pool 
-   * associated with this request is cleansed. This
-   * will give us the chance to close the file handle
-   * that we opened!
+   * Health checkers speak HEAD, and a HEAD response is nothing
+   * but the headers we were going to send anyway. Answer it
+   * right here, skipping the context allocation, the buffer and
+   * chain construction, and the client-body read entirely.
    */
-  cln = ngx_pool_cleanup_add(r->pool, 0);
-  if (!cln) {
+  if (r->method == NGX_HTTP_HEAD || r->header_only) {
+    ngx_rc = ngx_http_discard_request_body(r);
+    if (ngx_rc != NGX_OK) {
+      return ngx_rc;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "application/octet-stream");
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = unbounded ? -1 : (off_t)length;
+
+    return ngx_http_send_header(r);
+  }
+
+  dali_ctx = ngx_http_dali_acquire_ctx(r);
+  if (!dali_ctx) {
+    ngx_log_error(
+        NGX_LOG_CRIT, r->connection->log, 0,
+        "Dali could not allocate a Dali context");
     return NGX_HTTP_INTERNAL_SERVER_ERROR;
   }
-  cln->handler = ngx_http_dali_cleanup;
-  cln->data = dali_ctx;
 
   /*
-   * Configure the response buffer and chain appropriately.
+   * The context arrives zeroed (freshly calloc'd or reset by
+   * ngx_http_dali_acquire_ctx).
    */
-  dali_ctx->buffer->file_pos = 0;
-  dali_ctx->buffer->file_last = conf->length;
-  dali_ctx->buffer->in_file = 1;
-  dali_ctx->buffer->last_buf = 1;
-  dali_ctx->buffer->last_in_chain = 1;
+  dali_ctx->length = length;
+  dali_ctx->mode = conf->mode;
+  dali_ctx->payload = conf->payload;
+  dali_ctx->seed = conf->payload_seed;
+  dali_ctx->t_start = ngx_http_dali_monotonic_us();
+  dali_ctx->rate = conf->rate;
+  dali_ctx->chunk = conf->stream_chunk;
+  dali_ctx->interval = conf->stream_interval;
+  dali_ctx->unbounded = unbounded ? 1 : 0;
+
+  dali_ctx->delay = conf->delay;
+  if (conf->delay_jitter > 0) {
+    dali_ctx->delay +=
+        (ngx_msec_t)(ngx_http_dali_prng_next() % conf->delay_jitter);
+  }
 
-  dali_ctx->buffer->file->fd = dali_ctx->dev_zero_fd;
-  dali_ctx->buffer->file->name = dali_ctx->dev_zero_path;
-  dali_ctx->buffer->file->log = r->connection->log;
-  dali_ctx->buffer->file->directio = false;
+  /*
+   * A stall rides the delay timer with a delay nothing outlasts;
+   * an abort tears the connection down halfway through the body
+   * (the streaming path does the counting).
+   */
+  if (fault == NGX_HTTP_DALI_FAULT_STALL) {
+    dali_ctx->delay = NGX_HTTP_DALI_STALL_MSEC;
+  } else if (fault == NGX_HTTP_DALI_FAULT_ABORT && dali_ctx->length > 1) {
+    dali_ctx->abort_at = dali_ctx->length / 2;
+  }
 
-  dali_ctx->output_chain->buf = dali_ctx->buffer;
-  dali_ctx->output_chain->next = NULL;
+  /*
+   * Build the output chain for whichever serving mode this
+   * location is configured with. Responses longer than one ring
+   * buffer use the bounded streaming path when `dali_buffers` is
+   * configured; the chain is then built incrementally as the
+   * output filter drains it. Large h2/h3 responses stream too,
+   * with frame-aligned buffers (see ngx_http_dali_stream_init).
+   */
+  if (conf->mode == NGX_HTTP_DALI_MODE_ECHO) {
+    /*
+     * Echo responses reflect the client body, so the chain can
+     * only be built once the body has been read (see
+     * ngx_http_dali_build_echo_chain).
+     */
+    ngx_rc = NGX_OK;
+  } else if (dali_ctx->abort_at > 0 || dali_ctx->unbounded ||
+             conf->stream_interval > 0 ||
+             (conf->bufs.num > 0 &&
+              dali_ctx->length > (size_t)conf->bufs.size) ||
+             (conf->rate > 0 && dali_ctx->length > 0) ||
+             (conf->payload == NGX_HTTP_DALI_PAYLOAD_COUNTER &&
+              dali_ctx->length > NGX_HTTP_DALI_STREAM_BUF_SIZE) ||
+             (ngx_http_dali_multiplexed(r) &&
+              dali_ctx->length > NGX_HTTP_DALI_STREAM_BUF_SIZE)) {
+    ngx_rc = ngx_http_dali_stream_init(r, conf, dali_ctx);
+  } else if (conf->mode == NGX_HTTP_DALI_MODE_MEMORY) {
+    ngx_rc = ngx_http_dali_build_memory_chain(r, conf, dali_ctx);
+  } else {
+    ngx_rc = ngx_http_dali_build_file_chain(r, conf, dali_ctx);
+  }
+  if (ngx_rc != NGX_OK) {
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                  "Dali could not build the response chain");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
 
   ngx_http_set_ctx(r, dali_ctx, ngx_http_dali_module);
 
+  /*
+   * When the location is an upload sink (dali_discard_body on),
+   * let nginx's discard machinery drain and drop incoming bytes
+   * as they arrive -- nothing is buffered to memory or temp
+   * files -- and respond right away. Echo mode necessarily
+   * keeps the body, so it always takes the buffered read below.
+   */
+  if (conf->discard_body && conf->mode != NGX_HTTP_DALI_MODE_ECHO) {
+    ngx_rc = ngx_http_discard_request_body(r);
+    if (ngx_rc != NGX_OK) {
+      return ngx_rc;
+    }
+    return ngx_http_dali_send_response(r);
+  }
+
   ngx_rc = ngx_http_read_client_request_body(r, ngx_http_dali_client_body_fetched_handler);
 
   if (ngx_rc >= NGX_HTTP_SPECIAL_RESPONSE) {
@@ -296,6 +3121,21 @@ static void *ngx_http_dali_create_conf(ngx_conf_t *cf) {
     return NULL;
   }
   conf->length = NGX_CONF_UNSET_SIZE;
+  conf->max_length = NGX_CONF_UNSET_SIZE;
+  conf->rate = NGX_CONF_UNSET_SIZE;
+  conf->stream_chunk = NGX_CONF_UNSET_SIZE;
+  conf->stream_interval = NGX_CONF_UNSET_MSEC;
+  conf->delay = NGX_CONF_UNSET_MSEC;
+  conf->delay_jitter = NGX_CONF_UNSET_MSEC;
+  conf->mode = NGX_CONF_UNSET_UINT;
+  conf->payload = NGX_CONF_UNSET_UINT;
+  conf->unbounded = NGX_CONF_UNSET_UINT;
+  conf->discard_body = NGX_CONF_UNSET;
+  conf->cached_headers = NGX_CONF_UNSET;
+  conf->precompress = NGX_CONF_UNSET;
+  conf->length_cv = NGX_CONF_UNSET_PTR;
+  conf->dist = NGX_CONF_UNSET_UINT;
+  /* conf->bufs is left zeroed: streaming is off by default. */
   ngx_log_error(NGX_LOG_DEBUG, cf->log, 0,
                 "ngx_http_dali_create_conf returning: %uxL", (uintptr_t)conf);
   return conf;
@@ -324,6 +3164,340 @@ static char *ngx_http_dali_merge_conf(ngx_conf_t *cf, void *parent,
   if (prev->length > 0 && prev->length < conf->length) {
     conf->length = prev->length;
   }
+
+  ngx_conf_merge_uint_value(conf->mode, prev->mode, NGX_HTTP_DALI_MODE_FILE);
+  ngx_conf_merge_uint_value(conf->unbounded, prev->unbounded, 0);
+
+  /* The seed travels with the payload kind it was given for. */
+  if (conf->payload == NGX_CONF_UNSET_UINT) {
+    conf->payload_seed = prev->payload_seed;
+  }
+  ngx_conf_merge_uint_value(conf->payload, prev->payload,
+                            NGX_HTTP_DALI_PAYLOAD_ZERO);
+
+  /*
+   * Random bytes only exist in the in-memory arena, so a random
+   * payload implies memory-mode serving regardless of what the
+   * file-backed modes would have been. Remember that some
+   * location wants the arena so workers know to fill it. Counter
+   * bytes are generated per response, but they are generated into
+   * memory buffers, so they force memory mode the same way.
+   */
+  if (conf->payload == NGX_HTTP_DALI_PAYLOAD_RANDOM) {
+    conf->mode = NGX_HTTP_DALI_MODE_MEMORY;
+    ngx_http_dali_random_arena_wanted = 1;
+  } else if (conf->payload == NGX_HTTP_DALI_PAYLOAD_COUNTER) {
+    conf->mode = NGX_HTTP_DALI_MODE_MEMORY;
+  }
+
+  ngx_conf_merge_size_value(conf->max_length, prev->max_length, 0);
+
+  /*
+   * The cap applies to inherited lengths too; refusing the
+   * combination here keeps a fat-fingered size in an outer block
+   * from ever reaching a worker's buffer sizing.
+   */
+  if (conf->max_length > 0 && conf->length != NGX_CONF_UNSET_SIZE &&
+      conf->length > conf->max_length) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"dali\" size %uz exceeds its configured maximum %uz",
+                       conf->length, conf->max_length);
+    return NGX_CONF_ERROR;
+  }
+
+  ngx_conf_merge_size_value(conf->rate, prev->rate, 0);
+  ngx_conf_merge_size_value(conf->stream_chunk, prev->stream_chunk, 0);
+  ngx_conf_merge_msec_value(conf->stream_interval, prev->stream_interval, 0);
+  ngx_conf_merge_msec_value(conf->delay, prev->delay, 0);
+  ngx_conf_merge_msec_value(conf->delay_jitter, prev->delay_jitter, 0);
+  ngx_conf_merge_value(conf->discard_body, prev->discard_body, 0);
+  ngx_conf_merge_value(conf->cached_headers, prev->cached_headers, 0);
+  ngx_conf_merge_value(conf->precompress, prev->precompress, 0);
+  ngx_conf_merge_ptr_value(conf->length_cv, prev->length_cv, NULL);
+
+  if (conf->dist == NGX_CONF_UNSET_UINT) {
+    conf->dist = prev->dist != NGX_CONF_UNSET_UINT
+                     ? prev->dist
+                     : NGX_HTTP_DALI_DIST_NONE;
+    conf->dist_min = prev->dist_min;
+    conf->dist_max = prev->dist_max;
+    conf->dist_table = prev->dist_table;
+  }
+
+  if (conf->bufs.num == 0) {
+    conf->bufs = prev->bufs;
+  }
+
+  if (conf->fault_table == NULL) {
+    conf->fault_table = prev->fault_table;
+  }
+
+  /*
+   * When the length is variable, the cap is the only bound we
+   * know at configuration time; fold it into the maximum used to
+   * size the sendfile backing file at worker startup.
+   */
+  if (conf->length_cv && conf->max_length > ngx_http_dali_max_length) {
+    ngx_http_dali_max_length = conf->max_length;
+  }
+
+  /*
+   * Sendfile mode serves from a backing file whose size must be
+   * known at worker startup. A variable length with no cap has no
+   * config-time bound at all -- the file would never be created
+   * and every request would 500 -- and an unbounded stream can
+   * outrun any finite file. Refuse both combinations here, while
+   * the operator is still watching.
+   */
+  if (conf->mode == NGX_HTTP_DALI_MODE_SENDFILE) {
+    if (conf->length_cv && conf->max_length == 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "\"dali_mode sendfile\" with a variable length "
+                         "needs a \"max=\" or \"dali_max_length\" bound "
+                         "to size the backing file");
+      return NGX_CONF_ERROR;
+    }
+    if (conf->unbounded == 1) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                         "\"dali_mode sendfile\" cannot serve "
+                         "\"dali unbounded\": the backing file is finite");
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  ngx_conf_merge_str_value(conf->sendfile_dir, prev->sendfile_dir, "");
+  if (conf->sendfile_dir.len) {
+    ngx_http_dali_sendfile_dir = conf->sendfile_dir;
+  }
+
+#if (NGX_HTTP_GZIP)
+  /*
+   * Precompression only works for lengths that are known now, at
+   * configuration time; register this location's length so the
+   * workers can build its gzip blob once at startup.
+   */
+  if (conf->precompress && !conf->length_cv &&
+      conf->dist == NGX_HTTP_DALI_DIST_NONE &&
+      conf->length != NGX_CONF_UNSET_SIZE && conf->length > 0) {
+    ngx_uint_t i;
+
+    for (i = 0; i < ngx_http_dali_encoded_n; i++) {
+      if (ngx_http_dali_encoded[i].length == conf->length) {
+        break;
+      }
+    }
+    if (i == ngx_http_dali_encoded_n &&
+        ngx_http_dali_encoded_n < NGX_HTTP_DALI_ENCODED_MAX) {
+      ngx_http_dali_encoded[ngx_http_dali_encoded_n++].length = conf->length;
+    }
+  }
+#endif
+
+  /*
+   * Precompute the buffer fields that are the same for every
+   * request to this location, so the handler can instantiate the
+   * response buffer with a single structure copy.
+   */
+  ngx_memzero(&conf->buffer_template, sizeof(ngx_buf_t));
+  if (conf->mode == NGX_HTTP_DALI_MODE_MEMORY) {
+    conf->buffer_template.memory = 1;
+  } else {
+    conf->buffer_template.in_file = 1;
+  }
+  conf->buffer_template.last_buf = 1;
+  conf->buffer_template.last_in_chain = 1;
+
+  /*
+   * When the cached-header fast path can apply (fixed length, no
+   * distribution or variable), serialize both Connection variants
+   * now so no request ever takes the lazy-build branch.
+   */
+  if (conf->cached_headers && conf->dist == NGX_HTTP_DALI_DIST_NONE &&
+      !conf->length_cv && conf->length != NGX_CONF_UNSET_SIZE) {
+    if (ngx_http_dali_build_header_blob(conf, cf->pool, 0) != NGX_OK ||
+        ngx_http_dali_build_header_blob(conf, cf->pool, 1) != NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * ngx_http_dali_probit
+ *
+ * The inverse of the standard normal CDF (Acklam's rational
+ * approximation, good to ~1e-9). Configuration-time only: it is
+ * used to tabulate the lognormal quantiles.
+ *
+ * Input: A probability in (0, 1).
+ * Output: The corresponding standard normal quantile.
+ */
+static double ngx_http_dali_probit(double u) {
+  static const double a[] = {-3.969683028665376e+01, 2.209460984245205e+02,
+                             -2.759285104469687e+02, 1.383577518672690e+02,
+                             -3.066479806614716e+01, 2.506628277459239e+00};
+  static const double b[] = {-5.447609879822406e+01, 1.615858368580409e+02,
+                             -1.556989798598866e+02, 6.680131188771972e+01,
+                             -1.328068155288572e+01};
+  static const double c[] = {-7.784894002430293e-03, -3.223964580411365e-01,
+                             -2.400758277161838e+00, -2.549732539343734e+00,
+                             4.374664141464968e+00,  2.938163982698783e+00};
+  static const double d[] = {7.784695709041462e-03, 3.224671290700398e-01,
+                             2.445134137142996e+00, 3.754408661907416e+00};
+  double q, x;
+
+  if (u < 0.02425) {
+    q = sqrt(-2.0 * log(u));
+    return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q +
+            c[5]) /
+           ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+  }
+
+  if (u > 1.0 - 0.02425) {
+    q = sqrt(-2.0 * log(1.0 - u));
+    return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q +
+             c[5]) /
+           ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1.0);
+  }
+
+  q = u - 0.5;
+  x = q * q;
+  return (((((a[0] * x + a[1]) * x + a[2]) * x + a[3]) * x + a[4]) * x +
+          a[5]) *
+         q /
+         (((((b[0] * x + b[1]) * x + b[2]) * x + b[3]) * x + b[4]) * x + 1.0);
+}
+
+/*
+ * ngx_http_dali_parse_distribution
+ *
+ * Parse the distribution form of the `dali` directive and build
+ * whatever quantile table the sampler needs, all at
+ * configuration time:
+ *
+ *   dali uniform   <min> <max>
+ *   dali pareto    <min> <max> <alpha>
+ *   dali lognormal <median> <sigma> [<max>]
+ *
+ * Input: The configuration being parsed and this location's
+ * Dali configuration.
+ * Output: The result of processing the command.
+ */
+static char *ngx_http_dali_parse_distribution(ngx_conf_t *cf,
+                                              ngx_http_dali_conf_t *dali_conf) {
+  ngx_str_t *value = cf->args->elts;
+  ssize_t min, max;
+  ngx_int_t fixed;
+  double shape, u, q, mu;
+  ngx_uint_t i;
+
+  if (dali_conf->dist != NGX_CONF_UNSET_UINT) {
+    return "is duplicate";
+  }
+
+  if (ngx_strcmp(value[1].data, "uniform") == 0) {
+    if (cf->args->nelts != 4) {
+      return "uniform takes a minimum and a maximum";
+    }
+    min = ngx_parse_size(&value[2]);
+    max = ngx_parse_size(&value[3]);
+    if (min == NGX_ERROR || max == NGX_ERROR || min > max) {
+      return "has invalid uniform bounds";
+    }
+
+    dali_conf->dist = NGX_HTTP_DALI_DIST_UNIFORM;
+    dali_conf->dist_min = min;
+    dali_conf->dist_max = max;
+
+  } else if (ngx_strcmp(value[1].data, "pareto") == 0) {
+    if (cf->args->nelts != 5) {
+      return "pareto takes a minimum, a maximum, and a shape";
+    }
+    min = ngx_parse_size(&value[2]);
+    max = ngx_parse_size(&value[3]);
+    fixed = ngx_atofp(value[4].data, value[4].len, 3);
+    if (min == NGX_ERROR || max == NGX_ERROR || min <= 0 || min > max ||
+        fixed == NGX_ERROR || fixed == 0) {
+      return "has invalid pareto parameters";
+    }
+    shape = fixed / 1000.0;
+
+    dali_conf->dist_table = ngx_palloc(
+        cf->pool, NGX_HTTP_DALI_DIST_TABLE_SIZE * sizeof(size_t));
+    if (!dali_conf->dist_table) {
+      return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < NGX_HTTP_DALI_DIST_TABLE_SIZE; i++) {
+      u = (i + 0.5) / NGX_HTTP_DALI_DIST_TABLE_SIZE;
+      q = min * pow(1.0 - u, -1.0 / shape);
+      if (q > (double)max) {
+        q = (double)max;
+      }
+      dali_conf->dist_table[i] = (size_t)q;
+    }
+
+    dali_conf->dist = NGX_HTTP_DALI_DIST_PARETO;
+    dali_conf->dist_min = min;
+    dali_conf->dist_max = max;
+
+  } else if (ngx_strcmp(value[1].data, "lognormal") == 0) {
+    if (cf->args->nelts != 4 && cf->args->nelts != 5) {
+      return "lognormal takes a median, a sigma, and an optional maximum";
+    }
+    min = ngx_parse_size(&value[2]);
+    fixed = ngx_atofp(value[3].data, value[3].len, 3);
+    if (min == NGX_ERROR || min <= 0 || fixed == NGX_ERROR) {
+      return "has invalid lognormal parameters";
+    }
+    shape = fixed / 1000.0;
+
+    max = 0;
+    if (cf->args->nelts == 5) {
+      max = ngx_parse_size(&value[4]);
+      if (max == NGX_ERROR || max < min) {
+        return "has an invalid lognormal maximum";
+      }
+    }
+
+    dali_conf->dist_table = ngx_palloc(
+        cf->pool, NGX_HTTP_DALI_DIST_TABLE_SIZE * sizeof(size_t));
+    if (!dali_conf->dist_table) {
+      return NGX_CONF_ERROR;
+    }
+
+    mu = log((double)min);
+    for (i = 0; i < NGX_HTTP_DALI_DIST_TABLE_SIZE; i++) {
+      u = (i + 0.5) / NGX_HTTP_DALI_DIST_TABLE_SIZE;
+      q = exp(mu + shape * ngx_http_dali_probit(u));
+      if (max > 0 && q > (double)max) {
+        q = (double)max;
+      }
+      dali_conf->dist_table[i] = (size_t)q;
+      if (dali_conf->dist_table[i] > (size_t)max) {
+        max = (ssize_t)dali_conf->dist_table[i];
+      }
+    }
+
+    dali_conf->dist = NGX_HTTP_DALI_DIST_LOGNORMAL;
+    dali_conf->dist_min = min;
+    dali_conf->dist_max = max;
+
+  } else {
+    return "has an unknown distribution";
+  }
+
+  dali_conf->length = 0;
+
+  /*
+   * The largest drawable size participates in the sendfile
+   * backing-file sizing, just like literal lengths do.
+   */
+  if (dali_conf->dist_max > ngx_http_dali_max_length) {
+    ngx_http_dali_max_length = dali_conf->dist_max;
+  }
+
   return NGX_CONF_OK;
 }
 
@@ -346,6 +3520,10 @@ static char *ngx_http_dali_enable(ngx_conf_t *cf, ngx_command_t *cmd,
   ngx_log_error(NGX_LOG_DEBUG, cf->log, 0,
                 "ngx_http_dali_enable starting (conf: %uxL)", (uintptr_t)conf);
   ngx_http_core_loc_conf_t *clcf;
+  ngx_http_dali_conf_t *dali_conf = conf;
+  ngx_http_compile_complex_value_t ccv;
+  ngx_str_t *value;
+  char *rv;
 
   // Behind the scenes there is a tremendous amount of trickery required
   // in order to make this module implementation work out properly. In other
@@ -356,5 +3534,355 @@ static char *ngx_http_dali_enable(ngx_conf_t *cf, ngx_command_t *cmd,
    * get matched to the location being configured! This is key!
    */
   clcf->handler = ngx_http_dali_handler;
-  return ngx_conf_set_size_slot(cf, cmd, conf);
+
+  if (ngx_http_dali_add_stats_zone(cf) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  value = cf->args->elts;
+
+  /*
+   * `dali unbounded` asks for a response with no length at all:
+   * no Content-Length is sent and the body runs until the client
+   * disconnects. The length stays unset on purpose -- the handler
+   * keys the endless-stream path off this flag alone.
+   */
+  if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "unbounded") == 0) {
+    if (dali_conf->unbounded != NGX_CONF_UNSET_UINT) {
+      return "is duplicate";
+    }
+    dali_conf->unbounded = 1;
+    return NGX_CONF_OK;
+  }
+
+  /*
+   * The multi-argument distribution forms name their distribution
+   * first; everything below handles the classic size directive,
+   * with or without a max= cap.
+   */
+  if (cf->args->nelts > 2 &&
+      (ngx_strcmp(value[1].data, "uniform") == 0 ||
+       ngx_strcmp(value[1].data, "pareto") == 0 ||
+       ngx_strcmp(value[1].data, "lognormal") == 0)) {
+    return ngx_http_dali_parse_distribution(cf, dali_conf);
+  }
+
+  /*
+   * An optional `max=<size>` caps what this location will ever
+   * serve -- the same bound dali_max_length sets -- so a typo'd
+   * or hostile size is refused here, at configuration time,
+   * instead of sizing buffers at request time.
+   */
+  if (cf->args->nelts == 3) {
+    ngx_str_t max_str;
+    ssize_t max_size;
+
+    if (ngx_strncmp(value[2].data, "max=", 4) != 0) {
+      return "has an invalid parameter (expected max=<size>)";
+    }
+
+    max_str.data = value[2].data + 4;
+    max_str.len = value[2].len - 4;
+    max_size = ngx_parse_size(&max_str);
+    if (max_size == NGX_ERROR || max_size == 0) {
+      return "has an invalid max= size";
+    }
+    dali_conf->max_length = (size_t)max_size;
+  }
+
+  /*
+   * A `dali` value containing variables (e.g. `dali $arg_size`)
+   * cannot be resolved until request time. Compile it once here
+   * so the handler only has to evaluate it, and leave the
+   * literal-size path untouched for everyone else.
+   */
+  if (ngx_http_script_variables_count(&value[1])) {
+    if (dali_conf->length_cv != NGX_CONF_UNSET_PTR) {
+      return "is duplicate";
+    }
+
+    dali_conf->length_cv =
+        ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (!dali_conf->length_cv) {
+      return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = dali_conf->length_cv;
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+      return NGX_CONF_ERROR;
+    }
+
+    dali_conf->length = 0;
+    return NGX_CONF_OK;
+  }
+
+  rv = ngx_conf_set_size_slot(cf, cmd, conf);
+  if (rv != NGX_CONF_OK) {
+    return rv;
+  }
+
+  if (dali_conf->max_length != NGX_CONF_UNSET_SIZE &&
+      dali_conf->length != NGX_CONF_UNSET_SIZE &&
+      dali_conf->length > dali_conf->max_length) {
+    return "has a size larger than its max= cap";
+  }
+
+  /*
+   * Track the largest length configured anywhere so the worker
+   * startup hook knows how big to make the sendfile backing file.
+   */
+  if (dali_conf->length != NGX_CONF_UNSET_SIZE &&
+      dali_conf->length > ngx_http_dali_max_length) {
+    ngx_http_dali_max_length = dali_conf->length;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * ngx_http_dali_set_delay
+ *
+ * This function is invoked by nginx when it sees a `dali_delay`
+ * directive in the configuration file. It takes a base delay and
+ * an optional jitter, both in nginx time syntax (e.g.
+ * `dali_delay 150ms 50ms`).
+ *
+ * Input: The overall server configuration
+ *        The text of the raw configuration command being processed
+ *        A pointer to this location's Dali configuration
+ * Output: The result of processing the command.
+ */
+static char *ngx_http_dali_set_delay(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf) {
+  ngx_http_dali_conf_t *dali_conf = conf;
+  ngx_str_t *value;
+  ngx_int_t ms;
+
+  if (dali_conf->delay != NGX_CONF_UNSET_MSEC) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  ms = ngx_parse_time(&value[1], 0);
+  if (ms == NGX_ERROR) {
+    return "has an invalid delay";
+  }
+  dali_conf->delay = (ngx_msec_t)ms;
+
+  if (cf->args->nelts == 3) {
+    ms = ngx_parse_time(&value[2], 0);
+    if (ms == NGX_ERROR) {
+      return "has an invalid jitter";
+    }
+    dali_conf->delay_jitter = (ngx_msec_t)ms;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * ngx_http_dali_set_stream
+ *
+ * This function is invoked by nginx when it sees a `dali_stream`
+ * directive in the configuration file. It takes a chunk size and
+ * an emission interval (e.g. `dali_stream 4k 1s`).
+ *
+ * Input: The overall server configuration
+ *        The text of the raw configuration command being processed
+ *        A pointer to this location's Dali configuration
+ * Output: The result of processing the command.
+ */
+static char *ngx_http_dali_set_stream(ngx_conf_t *cf, ngx_command_t *cmd,
+                                      void *conf) {
+  ngx_http_dali_conf_t *dali_conf = conf;
+  ngx_str_t *value;
+  ssize_t chunk;
+  ngx_int_t ms;
+
+  if (dali_conf->stream_interval != NGX_CONF_UNSET_MSEC) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  chunk = ngx_parse_size(&value[1]);
+  if (chunk == NGX_ERROR || chunk == 0) {
+    return "has an invalid chunk size";
+  }
+  dali_conf->stream_chunk = (size_t)chunk;
+
+  ms = ngx_parse_time(&value[2], 0);
+  if (ms == NGX_ERROR || ms == 0) {
+    return "has an invalid interval";
+  }
+  dali_conf->stream_interval = (ngx_msec_t)ms;
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * ngx_http_dali_set_payload
+ *
+ * This function is invoked by nginx when it sees a `dali_payload`
+ * directive: `zero`, `random`, or `counter [<seed>]` (the seed
+ * defaults to zero, and only the counter form takes one).
+ *
+ * Input: The overall server configuration
+ *        The text of the raw configuration command being processed
+ *        A pointer to this location's Dali configuration
+ * Output: The result of processing the command.
+ */
+static char *ngx_http_dali_set_payload(ngx_conf_t *cf, ngx_command_t *cmd,
+                                       void *conf) {
+  ngx_http_dali_conf_t *dali_conf = conf;
+  ngx_str_t *value;
+  ngx_int_t seed;
+
+  if (dali_conf->payload != NGX_CONF_UNSET_UINT) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  if (ngx_strcmp(value[1].data, "zero") == 0) {
+    dali_conf->payload = NGX_HTTP_DALI_PAYLOAD_ZERO;
+  } else if (ngx_strcmp(value[1].data, "random") == 0) {
+    dali_conf->payload = NGX_HTTP_DALI_PAYLOAD_RANDOM;
+  } else if (ngx_strcmp(value[1].data, "counter") == 0) {
+    dali_conf->payload = NGX_HTTP_DALI_PAYLOAD_COUNTER;
+  } else {
+    return "has an unknown payload kind";
+  }
+
+  if (cf->args->nelts == 3) {
+    if (dali_conf->payload != NGX_HTTP_DALI_PAYLOAD_COUNTER) {
+      return "only takes a seed with the counter payload";
+    }
+    seed = ngx_atoi(value[2].data, value[2].len);
+    if (seed == NGX_ERROR) {
+      return "has an invalid seed";
+    }
+    dali_conf->payload_seed = (uint64_t)seed;
+  }
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * ngx_http_dali_set_fault
+ *
+ * This function is invoked by nginx when it sees a `dali_fault`
+ * directive (e.g. `dali_fault error 5%`). It compiles the
+ * requested rate into the location's fault schedule: percent% of
+ * the table's slots are set to the fault kind, scattered by a
+ * deterministic splitmix64 walk so every worker (and every
+ * reload) runs the identical schedule. Several dali_fault
+ * directives share one table; oversubscribing it is refused.
+ *
+ * Input: The overall server configuration
+ *        The text of the raw configuration command being processed
+ *        A pointer to this location's Dali configuration
+ * Output: The result of processing the command.
+ */
+static char *ngx_http_dali_set_fault(ngx_conf_t *cf, ngx_command_t *cmd,
+                                     void *conf) {
+  ngx_http_dali_conf_t *dali_conf = conf;
+  ngx_str_t *value, pct_str;
+  ngx_int_t percent;
+  ngx_uint_t kind, slots, placed, used, i;
+  uint64_t s, z;
+
+  value = cf->args->elts;
+
+  if (ngx_strcmp(value[1].data, "error") == 0) {
+    kind = NGX_HTTP_DALI_FAULT_ERROR;
+  } else if (ngx_strcmp(value[1].data, "stall") == 0) {
+    kind = NGX_HTTP_DALI_FAULT_STALL;
+  } else if (ngx_strcmp(value[1].data, "abort") == 0) {
+    kind = NGX_HTTP_DALI_FAULT_ABORT;
+  } else {
+    return "has an unknown fault kind";
+  }
+
+  pct_str = value[2];
+  if (pct_str.len > 1 && pct_str.data[pct_str.len - 1] == '%') {
+    pct_str.len--;
+  }
+  percent = ngx_atoi(pct_str.data, pct_str.len);
+  if (percent == NGX_ERROR || percent < 1 || percent > 100) {
+    return "has an invalid percentage";
+  }
+
+  if (!dali_conf->fault_table) {
+    dali_conf->fault_table =
+        ngx_pcalloc(cf->pool, NGX_HTTP_DALI_FAULT_TABLE_SIZE);
+    if (!dali_conf->fault_table) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  used = 0;
+  for (i = 0; i < NGX_HTTP_DALI_FAULT_TABLE_SIZE; i++) {
+    if (dali_conf->fault_table[i] != NGX_HTTP_DALI_FAULT_NONE) {
+      used++;
+    }
+  }
+
+  slots = (ngx_uint_t)percent * NGX_HTTP_DALI_FAULT_TABLE_SIZE / 100;
+  if (used + slots > NGX_HTTP_DALI_FAULT_TABLE_SIZE) {
+    return "oversubscribes the fault schedule (rates sum past 100%)";
+  }
+
+  /*
+   * A fixed seed (keyed only by the kind) keeps the schedule
+   * independent of parse order, worker, and reload.
+   */
+  s = 0x9e3779b97f4a7c15ULL * (kind + 1);
+  placed = 0;
+  while (placed < slots) {
+    s += 0x9e3779b97f4a7c15ULL;
+    z = s;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+
+    i = (ngx_uint_t)(z & (NGX_HTTP_DALI_FAULT_TABLE_SIZE - 1));
+    if (dali_conf->fault_table[i] == NGX_HTTP_DALI_FAULT_NONE) {
+      dali_conf->fault_table[i] = (u_char)kind;
+      placed++;
+    }
+  }
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * ngx_http_dali_status_enable
+ *
+ * This function is invoked by nginx when it sees a `dali_status`
+ * directive in the configuration file. It installs the status
+ * handler for the location and makes sure the shared counter
+ * zone exists.
+ *
+ * Input: The overall server configuration
+ *        The text of the raw configuration command being processed
+ *        A pointer to this location's Dali configuration (unused)
+ * Output: The result of processing the command.
+ */
+static char *ngx_http_dali_status_enable(ngx_conf_t *cf, ngx_command_t *cmd,
+                                         void *conf) {
+  ngx_http_core_loc_conf_t *clcf;
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_dali_status_handler;
+
+  if (ngx_http_dali_add_stats_zone(cf) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
 }